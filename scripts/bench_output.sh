@@ -0,0 +1,40 @@
+#!/bin/bash
+# Measures how fast sbva writes its output CNF. The example CNF is scaled up
+# by taking disjoint copies of it, and sbva is run with no step budget so
+# the (deduplicated) input is written straight back out.
+#
+# usage: bench_output.sh [sbva binary] [input cnf] [copies]
+set -e
+
+SBVA=${1:-./sbva}
+INPUT=${2:-../examples/d5-10-rand.cnf}
+COPIES=${3:-400}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+awk -v copies="$COPIES" '
+    /^c/ { next }
+    /^p/ { nv = $3; next }
+    NF > 0 { cls[n++] = $0 }
+    END {
+        print "p cnf", nv * copies, n * copies
+        for (k = 0; k < copies; k++) {
+            off = k * nv
+            for (i = 0; i < n; i++) {
+                m = split(cls[i], lits, " ")
+                line = ""
+                for (j = 1; j <= m; j++) {
+                    l = lits[j] + 0
+                    if (l > 0) l += off
+                    else if (l < 0) l -= off
+                    line = line l " "
+                }
+                print substr(line, 1, length(line) - 1)
+            }
+        }
+    }' "$INPUT" > "$TMP/in.cnf"
+
+secs=$("$SBVA" -v 1 -s 0 "$TMP/in.cnf" "$TMP/out.cnf" | awk '/output written in/ { print $5 }')
+bytes=$(wc -c < "$TMP/out.cnf")
+awk -v b="$bytes" -v s="$secs" 'BEGIN {
+    printf "wrote %.1f MB in %.3f s: %.1f MB/s\n", b / 1e6, s, b / 1e6 / s }'
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Compares round-based SBVA (--rounds) against the classic engine: size of
+# the reduced formula and wall time. The example CNF is scaled up by taking
+# copies of it, chained into one component by a few clauses between
+# neighbouring copies.
+#
+# usage: bench_rounds.sh [sbva binary] [input cnf] [copies] [round sizes] [thread counts]
+set -e
+
+SBVA=${1:-./sbva}
+INPUT=${2:-../examples/d5-10-rand.cnf}
+COPIES=${3:-60}
+ROUNDS=${4:-"16 64 256"}
+THREADS=${5:-"1 2 4 8"}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+awk -v copies="$COPIES" '
+    /^c/ { next }
+    /^p/ { nv = $3; next }
+    NF > 0 { cls[n++] = $0 }
+    END {
+        srand(1)
+        links = 20
+        print "p cnf", nv * copies, n * copies + links * (copies - 1)
+        for (k = 0; k < copies; k++) {
+            off = k * nv
+            for (i = 0; i < n; i++) {
+                m = split(cls[i], lits, " ")
+                line = ""
+                for (j = 1; j <= m; j++) {
+                    l = lits[j] + 0
+                    if (l > 0) l += off
+                    else if (l < 0) l -= off
+                    line = line l " "
+                }
+                print substr(line, 1, length(line) - 1)
+            }
+        }
+        for (k = 0; k + 1 < copies; k++) {
+            for (i = 0; i < links; i++) {
+                a = k * nv + int(rand() * nv) + 1
+                b = (k + 1) * nv + int(rand() * nv) + 1
+                print (rand() < 0.5 ? -a : a), (rand() < 0.5 ? -b : b), 0
+            }
+        }
+    }' "$INPUT" > "$TMP/in.cnf"
+
+run() {
+    local start end
+    start=$(date +%s.%N)
+    "$SBVA" "$@" "$TMP/in.cnf" "$TMP/out.cnf" > /dev/null
+    end=$(date +%s.%N)
+    awk -v s="$start" -v e="$end" -v name="$*" '
+        /^p/ { printf "%-24s %8d vars %9d clauses %8.2f s\n", name, $3, $4, e - s; exit }' "$TMP/out.cnf"
+}
+
+run -t 1
+for r in $ROUNDS; do
+    for t in $THREADS; do
+        run --rounds "$r" -t "$t"
+    done
+done
@@ -0,0 +1,247 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if !defined(_MSC_VER) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SBVA_MMAP
+#endif
+
+namespace SBVAImpl {
+
+// Binary CNF format. All integers are little-endian.
+//
+//   header   8-byte magic "SBVACNF" + version, then u64 num_vars,
+//            num_clauses, num_lits and flags
+//   offsets  (num_clauses + 1) x u64, or u32 if flagged: where each clause
+//            record starts in the data section; the last entry is the size
+//            of the data section
+//   data     per clause: varint number of literals, the first literal
+//            zigzag-encoded, then the non-negative differences between
+//            consecutive literals, which are sorted
+//
+// Clauses are stored the way Formula keeps them (sorted literals), so loading
+// only has to expand the varints. The offset table allows jumping to any
+// clause without decoding the ones before it.
+static const char binary_cnf_magic[8] = {'S', 'B', 'V', 'A', 'C', 'N', 'F', 1};
+static const size_t binary_cnf_header_size = 8 + 4 * 8;
+
+// Set when no clause is a duplicate of another, loading can skip the check
+static const uint64_t binary_cnf_deduplicated = 1;
+// Set when the offset table holds u32 entries
+static const uint64_t binary_cnf_offsets32 = 2;
+
+struct BinaryCnfHeader {
+    uint64_t num_vars = 0;
+    uint64_t num_clauses = 0;
+    uint64_t num_lits = 0;
+    uint64_t flags = 0;
+};
+
+static inline bool is_binary_cnf(const char* data, size_t len) {
+    return len >= sizeof(binary_cnf_magic)
+        && memcmp(data, binary_cnf_magic, sizeof(binary_cnf_magic)) == 0;
+}
+
+static inline char* put_u64(uint64_t v, char* p) {
+    for (int i = 0; i < 8; i++) p[i] = (char)(v >> (8 * i));
+    return p + 8;
+}
+
+static inline uint64_t get_u64(const char* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    return v;
+}
+
+static inline char* put_u32(uint32_t v, char* p) {
+    for (int i = 0; i < 4; i++) p[i] = (char)(v >> (8 * i));
+    return p + 4;
+}
+
+static inline uint32_t get_u32(const char* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= (uint32_t)(unsigned char)p[i] << (8 * i);
+    return v;
+}
+
+static inline char* put_varint(uint32_t v, char* p) {
+    while (v > 127) {
+        *p++ = (char)((v & 127) | 128);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+// Returns nullptr if the varint runs past end or does not fit 32 bits.
+static inline const char* get_varint(const char* p, const char* end, uint32_t& v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+        const uint32_t b = (unsigned char)*p++;
+        v |= (b & 127) << shift;
+        if (b < 128) return p;
+    }
+    return nullptr;
+}
+
+static inline uint32_t zigzag(int lit) {
+    return ((uint32_t)lit << 1) ^ (uint32_t)(lit >> 31);
+}
+
+static inline int unzigzag(uint32_t u) {
+    return (int)(u >> 1) ^ -(int)(u & 1);
+}
+
+// Largest record encode_clause() can produce
+static inline size_t max_clause_record(size_t num_lits) {
+    return (num_lits + 1) * 5;
+}
+
+// lits must be sorted. Returns the end of the record.
+static inline char* encode_clause(const int* lits, size_t num, char* dst) {
+    dst = put_varint((uint32_t)num, dst);
+    if (num == 0) return dst;
+    dst = put_varint(zigzag(lits[0]), dst);
+    for (size_t i = 1; i < num; i++) {
+        dst = put_varint((uint32_t)lits[i] - (uint32_t)lits[i - 1], dst);
+    }
+    return dst;
+}
+
+// Read-only view of a binary CNF in memory, e.g. a mapped file.
+class BinaryCnfView {
+public:
+    // Checks the header and the offset table, returns false if they are
+    // inconsistent with len.
+    bool open(const char* _data, size_t len) {
+        data = _data;
+        if (len < binary_cnf_header_size || !is_binary_cnf(data, len)) return false;
+        const char* p = data + sizeof(binary_cnf_magic);
+        header.num_vars = get_u64(p);
+        header.num_clauses = get_u64(p + 8);
+        header.num_lits = get_u64(p + 16);
+        header.flags = get_u64(p + 24);
+        if (header.num_vars > (uint64_t)INT32_MAX) return false;
+
+        width = (header.flags & binary_cnf_offsets32) ? 4 : 8;
+        const uint64_t table_size = (len - binary_cnf_header_size) / width;
+        if (header.num_clauses >= table_size) return false;
+        offsets = data + binary_cnf_header_size;
+        body = offsets + (header.num_clauses + 1) * width;
+        body_size = offset(header.num_clauses);
+        return body_size <= (uint64_t)(data + len - body);
+    }
+
+    const BinaryCnfHeader& get_header() const { return header; }
+
+    // Decodes clause i into lits. Returns false if the record is corrupt.
+    bool clause(uint64_t i, std::vector<int>& lits) const {
+        const uint64_t from = offset(i);
+        const uint64_t to = offset(i + 1);
+        if (from > to || to > body_size) return false;
+        const char* p = body + from;
+        const char* end = body + to;
+
+        uint32_t num;
+        if ((p = get_varint(p, end, num)) == nullptr) return false;
+        if (num > (uint64_t)(end - p)) return false;
+        lits.resize(num);
+        if (num == 0) return p == end;
+
+        uint32_t u;
+        if ((p = get_varint(p, end, u)) == nullptr) return false;
+        int64_t lit = unzigzag(u);
+        lits[0] = (int)lit;
+        for (uint32_t k = 1; k < num; k++) {
+            if ((p = get_varint(p, end, u)) == nullptr) return false;
+            lit += u;
+            if (lit > INT32_MAX) return false;
+            lits[k] = (int)lit;
+        }
+        return p == end;
+    }
+
+private:
+    uint64_t offset(uint64_t i) const {
+        return width == 4 ? get_u32(offsets + i * 4) : get_u64(offsets + i * 8);
+    }
+
+    const char* data = nullptr;
+    const char* offsets = nullptr;
+    uint32_t width = 8;
+    const char* body = nullptr;
+    uint64_t body_size = 0;
+    BinaryCnfHeader header;
+};
+
+// Maps the rest of a regular file, from the FILE's current position, into
+// memory. Anything else (pipes, platforms without mmap) leaves it unmapped.
+class MappedFile {
+public:
+    explicit MappedFile(FILE* f) {
+#ifdef SBVA_MMAP
+        const int fd = fileno(f);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return;
+        const off_t pos = ftello(f);
+        if (pos < 0 || pos >= st.st_size) return;
+        void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) return;
+        base = (char*)m;
+        mapped = st.st_size;
+        start = base + pos;
+        len = st.st_size - pos;
+#else
+        (void)f;
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef SBVA_MMAP
+        if (base != nullptr) munmap(base, mapped);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return start; }
+    size_t size() const { return len; }
+
+private:
+    char* base = nullptr;
+    size_t mapped = 0;
+    const char* start = nullptr;
+    size_t len = 0;
+};
+
+}
@@ -0,0 +1,238 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_LZMA
+#include <lzma.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "parallel.h"
+
+namespace SBVAImpl {
+
+enum class Codec { Plain, Gzip, Xz, Zstd };
+
+static inline const char* codec_name(Codec c) {
+    switch (c) {
+        case Codec::Plain: return "plain";
+        case Codec::Gzip: return "gzip";
+        case Codec::Xz: return "xz";
+        case Codec::Zstd: return "zstd";
+    }
+    return "unknown";
+}
+
+static inline Codec detect_codec(const unsigned char* d, size_t len) {
+    if (len >= 2 && d[0] == 0x1f && d[1] == 0x8b) return Codec::Gzip;
+    if (len >= 6 && memcmp(d, "\xfd" "7zXZ\0", 6) == 0) return Codec::Xz;
+    if (len >= 4 && d[0] == 0x28 && d[1] == 0xb5 && d[2] == 0x2f && d[3] == 0xfd) return Codec::Zstd;
+    return Codec::Plain;
+}
+
+static inline bool codec_supported(Codec c) {
+    switch (c) {
+        case Codec::Plain: return true;
+#ifdef USE_ZLIB
+        case Codec::Gzip: return true;
+#endif
+#ifdef USE_LZMA
+        case Codec::Xz: return true;
+#endif
+#ifdef USE_ZSTD
+        case Codec::Zstd: return true;
+#endif
+        default: return false;
+    }
+}
+
+// Compresses everything handed to write() into out on a background thread.
+// Callers queue whole buffers, so formatting the next buffer overlaps with
+// compressing the previous one. The stream is completed by finish() or the
+// destructor.
+class Compressor {
+public:
+    static const size_t chunk_size = 1 << 20;
+
+    Compressor(FILE* _out, Codec _codec) : out(_out), codec(_codec) {
+        if (!codec_supported(codec) || codec == Codec::Plain) {
+            fprintf(stderr, "Error: SBVA was built without %s support\n", codec_name(codec));
+            exit(1);
+        }
+        worker = std::thread([this]() { run(); });
+    }
+
+    ~Compressor() {
+        finish();
+    }
+
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    void write(const char* data, size_t len) {
+        if (len == 0) return;
+        queue.push(std::vector<char>(data, data + len));
+    }
+
+    void finish() {
+        if (!worker.joinable()) return;
+        queue.push(std::vector<char>());
+        worker.join();
+        if (fflush(out) != 0 || ferror(out)) failed = true;
+        if (failed) {
+            fprintf(stderr, "Error: could not write %s compressed output\n", codec_name(codec));
+            exit(1);
+        }
+    }
+
+private:
+    void run() {
+        bool ended = false; // the end marker of finish() was taken off the queue
+        switch (codec) {
+#ifdef USE_ZLIB
+            case Codec::Gzip: failed = !deflate_gzip(ended); break;
+#endif
+#ifdef USE_LZMA
+            case Codec::Xz: failed = !deflate_xz(ended); break;
+#endif
+#ifdef USE_ZSTD
+            case Codec::Zstd: failed = !deflate_zstd(ended); break;
+#endif
+            default: failed = true; break;
+        }
+        // keep draining up to the end marker so that write() never blocks
+        // forever
+        while (failed && !ended && !queue.pop().empty()) {}
+    }
+
+    bool put(const char* data, size_t len) {
+        return fwrite(data, 1, len, out) == len;
+    }
+
+#ifdef USE_ZLIB
+    bool deflate_gzip(bool& ended) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // 15 window bits + 16: write a gzip header
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+        std::vector<char> dst(chunk_size);
+        bool ok = true;
+        bool done = false;
+        while (ok && !done) {
+            std::vector<char> src = queue.pop();
+            done = src.empty();
+            ended = done;
+            zs.next_in = (Bytef*)src.data();
+            zs.avail_in = (uInt)src.size();
+            int ret;
+            do {
+                zs.next_out = (Bytef*)dst.data();
+                zs.avail_out = (uInt)dst.size();
+                ret = deflate(&zs, done ? Z_FINISH : Z_NO_FLUSH);
+                if (ret == Z_STREAM_ERROR) ok = false;
+                else ok = put(dst.data(), dst.size() - zs.avail_out);
+            } while (ok && (zs.avail_out == 0 || (done && ret != Z_STREAM_END)));
+        }
+        deflateEnd(&zs);
+        return ok;
+    }
+#endif
+
+#ifdef USE_LZMA
+    bool deflate_xz(bool& ended) {
+        lzma_stream ls = LZMA_STREAM_INIT;
+        if (lzma_easy_encoder(&ls, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64) != LZMA_OK) return false;
+
+        std::vector<char> dst(chunk_size);
+        bool ok = true;
+        bool done = false;
+        while (ok && !done) {
+            std::vector<char> src = queue.pop();
+            done = src.empty();
+            ended = done;
+            ls.next_in = (const uint8_t*)src.data();
+            ls.avail_in = src.size();
+            lzma_ret ret;
+            do {
+                ls.next_out = (uint8_t*)dst.data();
+                ls.avail_out = dst.size();
+                ret = lzma_code(&ls, done ? LZMA_FINISH : LZMA_RUN);
+                if (ret != LZMA_OK && ret != LZMA_STREAM_END) ok = false;
+                else ok = put(dst.data(), dst.size() - ls.avail_out);
+            } while (ok && (ls.avail_out == 0 || (done && ret != LZMA_STREAM_END)));
+        }
+        lzma_end(&ls);
+        return ok;
+    }
+#endif
+
+#ifdef USE_ZSTD
+    bool deflate_zstd(bool& ended) {
+        ZSTD_CStream* zs = ZSTD_createCStream();
+        if (zs == nullptr) return false;
+        ZSTD_initCStream(zs, ZSTD_CLEVEL_DEFAULT);
+
+        std::vector<char> dst(ZSTD_CStreamOutSize());
+        bool ok = true;
+        bool done = false;
+        while (ok && !done) {
+            std::vector<char> src = queue.pop();
+            done = src.empty();
+            ended = done;
+            ZSTD_inBuffer input = {src.data(), src.size(), 0};
+            size_t remaining;
+            do {
+                ZSTD_outBuffer output = {dst.data(), dst.size(), 0};
+                remaining = ZSTD_compressStream2(zs, &output, &input,
+                    done ? ZSTD_e_end : ZSTD_e_continue);
+                if (ZSTD_isError(remaining)) ok = false;
+                else ok = put(dst.data(), output.pos);
+            } while (ok && (input.pos < input.size || (done && remaining != 0)));
+        }
+        ZSTD_freeCStream(zs);
+        return ok;
+    }
+#endif
+
+    FILE* out;
+    Codec codec;
+    std::thread worker;
+    ChunkQueue queue;
+    bool failed = false; // written by worker, read after join
+};
+
+}
@@ -0,0 +1,140 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace SBVAImpl {
+
+// A vector kept in fixed-size chunks that copies share until one side
+// writes. Copying it only copies the chunk pointers; the first non-const
+// access to an element of a shared chunk gives this vector a private copy
+// of that chunk. Const access never copies, so const member functions of
+// the owner can read from several threads while nobody writes.
+//
+// Element references stay valid when the vector grows. A reference from a
+// const access may point into a shared chunk, so it must not be kept past
+// a non-const access to the same chunk.
+template<class T, unsigned ChunkBits = 10>
+class CowVector {
+public:
+    static const size_t chunk_size = size_t(1) << ChunkBits;
+
+    size_t size() const { return num; }
+    bool empty() const { return num == 0; }
+    size_t capacity() const { return chunks.size() * chunk_size; }
+
+    const T& operator[](size_t i) const {
+        return chunks[i >> ChunkBits].p->items[i & (chunk_size - 1)];
+    }
+
+    T& operator[](size_t i) {
+        return own(i >> ChunkBits)[i & (chunk_size - 1)];
+    }
+
+    T& back() { return (*this)[num - 1]; }
+    const T& back() const { return (*this)[num - 1]; }
+
+    void reserve(size_t n) { chunks.reserve((n + chunk_size - 1) >> ChunkBits); }
+
+    // New elements are value-initialised, dropped ones are reset so that a
+    // later resize() sees fresh elements again
+    void resize(size_t n) {
+        for (size_t i = n; i < num && (i & (chunk_size - 1)) != 0; i++) (*this)[i] = T();
+        const size_t old_chunks = chunks.size();
+        chunks.resize((n + chunk_size - 1) >> ChunkBits);
+        for (size_t c = old_chunks; c < chunks.size(); c++) chunks[c].p = new Chunk();
+        num = n;
+    }
+
+    void push_back(const T& x) {
+        resize(num + 1);
+        back() = x;
+    }
+
+    void push_back(T&& x) {
+        resize(num + 1);
+        back() = std::move(x);
+    }
+
+    void clear() {
+        chunks.clear();
+        num = 0;
+    }
+
+    void swap(CowVector& other) {
+        chunks.swap(other.chunks);
+        std::swap(num, other.num);
+    }
+
+    // Makes the chunk holding element i private, so that several threads
+    // can then write to distinct elements of it without copying
+    void unshare(size_t i) { own(i >> ChunkBits); }
+
+private:
+    // elements are inline, so an access is two loads away from the table
+    struct Chunk {
+        std::atomic<size_t> refs{1};
+        T items[chunk_size];
+        Chunk() = default;
+        Chunk(const Chunk& other) { std::copy(other.items, other.items + chunk_size, items); }
+    };
+
+    // Counted reference to a chunk. The count is dropped with release and
+    // checked with acquire in own(), so whatever the other owners read from
+    // a chunk happens before its last owner writes to it.
+    struct Ref {
+        Chunk* p = nullptr;
+        Ref() = default;
+        Ref(const Ref& other) : p(other.p) {
+            if (p) p->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        Ref(Ref&& other) noexcept : p(other.p) { other.p = nullptr; }
+        Ref& operator=(Ref other) noexcept {
+            std::swap(p, other.p);
+            return *this;
+        }
+        ~Ref() {
+            if (p && p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete p;
+        }
+    };
+
+    T* own(size_t c) {
+        Ref& r = chunks[c];
+        if (r.p->refs.load(std::memory_order_acquire) != 1) {
+            Ref copy;
+            copy.p = new Chunk(*r.p);
+            r = std::move(copy);
+        }
+        return r.p->items;
+    }
+
+    std::vector<Ref> chunks;
+    size_t num = 0;
+};
+
+}
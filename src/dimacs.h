@@ -0,0 +1,137 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace SBVAImpl {
+
+// Streaming DIMACS tokenizer. Text is fed in blocks that end at a line break
+// or at the end of the input, and the clauses come out as 0-terminated
+// literals appended to a flat buffer. Clauses end at their 0 and may span
+// lines. Literals are checked against the header.
+class DimacsTokenizer {
+public:
+    void tokenize(const char* p, const char* end, std::vector<int>& out) {
+        while (true) {
+            while (p < end && is_space(*p)) p++;
+            if (p == end) return;
+
+            if (*p == 'c') {
+                p = (const char*)memchr(p, '\n', end - p);
+                if (p == nullptr) return;
+                continue;
+            }
+            if (*p == 'p') {
+                p = parse_header(p, end);
+                continue;
+            }
+
+            if (!found_header) {
+                fprintf(stderr, "Error: CNF file does not have a header\n");
+                exit(1);
+            }
+            const bool neg = *p == '-';
+            if (neg) p++;
+            if (p == end || *p < '0' || *p > '9') parse_error(p, end);
+            uint64_t var = 0;
+            while (p < end && *p >= '0' && *p <= '9') {
+                var = var * 10 + (*p++ - '0');
+                if (var > num_vars) {
+                    fprintf(stderr, "Error: CNF file has a variable that is greater than the number of variables specified in the header\n");
+                    exit(1);
+                }
+            }
+            if (p < end && !is_space(*p)) parse_error(p, end);
+
+            if (!clause_open) {
+                if (clauses_seen >= num_clauses) {
+                    fprintf(stderr, "Error: CNF file has more clauses than specified in header\n");
+                    exit(1);
+                }
+                clauses_seen++;
+                clause_open = var != 0;
+            } else if (var == 0) {
+                clause_open = false;
+            }
+            out.push_back(neg ? -(int)var : (int)var);
+        }
+    }
+
+    // Terminates a last clause that is missing its 0.
+    void finish(std::vector<int>& out) {
+        if (clause_open) out.push_back(0);
+        clause_open = false;
+    }
+
+    bool has_header() const { return found_header; }
+    uint64_t header_vars() const { return num_vars; }
+    uint64_t header_clauses() const { return num_clauses; }
+    uint64_t clauses() const { return clauses_seen; }
+
+private:
+    static bool is_space(char c) {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+    }
+
+    // "p cnf <vars> <clauses>", returns where the line ends
+    const char* parse_header(const char* p, const char* end) {
+        const char* line_end = (const char*)memchr(p, '\n', end - p);
+        if (line_end == nullptr) line_end = end;
+        const std::string line(p, line_end);
+        if (found_header) {
+            fprintf(stderr, "Error: CNF file has more than one header\n");
+            exit(1);
+        }
+        unsigned long vars = 0;
+        unsigned long cls = 0;
+        if (sscanf(line.c_str(), "p cnf %lu %lu", &vars, &cls) != 2 || vars > INT32_MAX) {
+            fprintf(stderr, "Error: malformed CNF header: %s\n", line.c_str());
+            exit(1);
+        }
+        num_vars = vars;
+        num_clauses = cls;
+        found_header = true;
+        return line_end;
+    }
+
+    [[noreturn]] static void parse_error(const char* p, const char* end) {
+        if (p == end) fprintf(stderr, "Error: CNF file ends in the middle of a literal\n");
+        else fprintf(stderr, "Error: unexpected character '%c' in CNF file\n", *p);
+        exit(1);
+    }
+
+    bool found_header = false;
+    uint64_t num_vars = 0;
+    uint64_t num_clauses = 0;
+    uint64_t clauses_seen = 0;
+    bool clause_open = false;
+};
+
+}
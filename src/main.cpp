@@ -21,9 +21,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ***********************************************/
 
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <ios>
+#include <iomanip>
 #include <iostream>
 #include <vector>
 #include <string>
@@ -43,19 +45,132 @@ using std::vector;
 
 using namespace SBVA;
 
-auto run_bva(FILE *fin, FILE *fout, FILE *fproof, Tiebreak tiebreak, Config& common) {
+const char* stop_reason_str(StopReason stop) {
+    switch (stop) {
+        case StopReason::Completed: return "none";
+        case StopReason::StepLimit: return "steps";
+        case StopReason::ReplaceLimit: return "maxreplace";
+        case StopReason::TimeLimit: return "time";
+        case StopReason::CpuLimit: return "cpu";
+        case StopReason::MemLimit: return "mem";
+        case StopReason::Cancelled: return "cancelled";
+        case StopReason::SliceLimit: return "slice";
+    }
+    return "unknown";
+}
+
+// One portfolio entry per ';'-separated part of spec, each a ','-separated
+// list of settings applied on top of the command line's: normal,
+// clscutoff=N, litscutoff=N, steps=N (millions) and maxreplace=N. An empty
+// part or "default" runs the command line's settings.
+bool parse_portfolio(const string& spec, const Config& common, Tiebreak tiebreak,
+                     vector<PortfolioEntry>& entries, vector<string>& names) {
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t end = spec.find(';', start);
+        if (end == string::npos) end = spec.size();
+        const string part = spec.substr(start, end - start);
+        start = end + 1;
+
+        PortfolioEntry e;
+        e.config = common;
+        e.config.num_threads = 1;
+        e.tiebreak = tiebreak;
+        size_t pos = 0;
+        while (pos < part.size()) {
+            size_t stop = part.find(',', pos);
+            if (stop == string::npos) stop = part.size();
+            const string opt = part.substr(pos, stop - pos);
+            pos = stop + 1;
+            const size_t eq = opt.find('=');
+            const string key = opt.substr(0, eq);
+            const char* val = eq == string::npos ? nullptr : opt.c_str() + eq + 1;
+            if (key == "default" && !val) continue;
+            else if (key == "normal" && !val) e.tiebreak = Tiebreak::None;
+            else if (key == "clscutoff" && val) e.config.matched_cls_cutoff = std::atoi(val);
+            else if (key == "litscutoff" && val) e.config.matched_lits_cutoff = std::atoi(val);
+            else if (key == "steps" && val) e.config.steps = 1e6 * std::atoll(val);
+            else if (key == "maxreplace" && val) e.config.max_replacements = std::atoi(val);
+            else {
+                cerr << "Error: unknown portfolio setting '" << opt << "'" << endl;
+                return false;
+            }
+        }
+        entries.push_back(e);
+        names.push_back(part.empty() ? "default" : part);
+    }
+    return true;
+}
+
+auto run_bva(FILE *fin, FILE *fout, FILE *fproof, Tiebreak tiebreak, const Config& common, Stats& stats,
+             bool convert, bool delta, const vector<PortfolioEntry>& portfolio,
+             const vector<string>& portfolio_names, bool portfolio_first) {
     CNF f;
     f.parse_cnf(fin, common);
-    f.run(tiebreak);
-    auto ret = f.to_cnf(fout);
-    if (fproof != nullptr) f.to_proof(fproof);
+    if (!convert) {
+        if (fproof != nullptr) f.stream_proof(fproof);
+        if (portfolio.empty()) {
+            f.run(tiebreak);
+        } else {
+            vector<PortfolioResult> results;
+            const size_t kept = f.run_portfolio(portfolio, portfolio_first, results);
+            for (size_t i = 0; i < results.size(); i++) {
+                const PortfolioResult& r = results[i];
+                cout << "c portfolio " << i << " (" << portfolio_names[i] << "): ";
+                if (!r.started) {
+                    cout << "not started" << endl;
+                    continue;
+                }
+                cout << "vars " << r.num_vars << " cls " << r.num_clauses
+                    << " steps remainK: " << std::setprecision(2) << std::fixed << (double)r.steps_left/1000.0
+                    << " Limit: " << stop_reason_str(r.stop)
+                    << " T: " << std::setprecision(2) << std::fixed << r.time
+                    << (i == kept ? " kept" : "") << endl;
+            }
+        }
+    }
+    stats = f.stats();
+
+    auto out_start = std::chrono::steady_clock::now();
+    auto ret = delta ? f.to_delta(fout) : f.to_cnf(fout);
+    fflush(fout);
+    if (common.verbosity) {
+        std::chrono::duration<double> out_time = std::chrono::steady_clock::now() - out_start;
+        cout << "c output written in " << std::setprecision(3) << std::fixed
+            << out_time.count() << " s" << endl;
+    }
     return ret;
 }
 
+// Compression implied by a file name's extension
+Compression compression_for(const string& fname) {
+    auto ends_with = [&](const char* ext) {
+        const string e(ext);
+        return fname.size() > e.size() && fname.compare(fname.size() - e.size(), e.size(), e) == 0;
+    };
+    if (ends_with(".gz")) return GzipCompression;
+    if (ends_with(".xz")) return XzCompression;
+    if (ends_with(".zst")) return ZstdCompression;
+    return NoCompression;
+}
+
+// Whether a file name asks for the binary CNF format, e.g. "f.bcnf" or "f.bcnf.gz"
+bool binary_cnf_for(string fname) {
+    const size_t dot = fname.rfind('.');
+    if (dot != string::npos && compression_for(fname) != NoCompression) fname.resize(dot);
+    return fname.size() > 5 && fname.compare(fname.size() - 5, 5, ".bcnf") == 0;
+}
+
 argparse::ArgumentParser program = argparse::ArgumentParser("sbva");
 int main(int argc, char **argv) {
     Config config;
     FILE *fproof = nullptr;
+    string proof_fname;
+    string compress;
+    bool convert = false;
+    bool delta = false;
+    string portfolio_spec;
+    bool portfolio_first = false;
     Tiebreak tiebreak = Tiebreak::ThreeHop;
 
     program.add_argument("-v", "--verb")
@@ -65,20 +180,80 @@ int main(int argc, char **argv) {
     program.add_argument("-p", "--proof")
         .action([&](const auto& a) {
                 config.generate_proof = true;
-                fproof = fopen(a.c_str(), "w");
+                proof_fname = a;
+                fproof = fopen(a.c_str(), "wb");
                 if (fproof == nullptr) {
                 std::cerr << "Error: Could not open file " << a << " for reading" << endl;
                 }
         })
         .help("Emit proof file here");
+    program.add_argument("--proof-binary")
+        .action([&](const auto&) {config.proof_binary = true;})
+        .flag()
+        .help("Emit the proof in binary DRAT format");
+    program.add_argument("--binary-cnf")
+        .action([&](const auto&) {config.binary_cnf = true;})
+        .flag()
+        .help("Write the output CNF in binary format. Also picked by a .bcnf extension");
+    program.add_argument("--convert")
+        .action([&](const auto&) {convert = true;})
+        .flag()
+        .help("Only translate the input (DIMACS or binary) to the output format, do not run SBVA");
+    program.add_argument("--delta")
+        .action([&](const auto&) {delta = true;})
+        .flag()
+        .help("Write only the removed (by input position) and added clauses");
+    program.add_argument("--compress")
+        .action([&](const auto& a) {compress = a;})
+        .help("Compress output and proof: gz, xz or zst. By default picked from the file extension");
     program.add_argument("-s", "--steps")
         .action([&](const auto& a) {config.steps = 1e6 * std::atoll(a.c_str());})
         .default_value(config.steps)
         .help("Number of computation steps to do");
+    program.add_argument("--time-limit")
+        .action([&](const auto& a) {config.time_limit = std::atof(a.c_str());})
+        .default_value(config.time_limit)
+        .help("Wall-clock time limit in seconds. 0 = no limit");
+    program.add_argument("--cpu-limit")
+        .action([&](const auto& a) {config.cpu_limit = std::atof(a.c_str());})
+        .default_value(config.cpu_limit)
+        .help("CPU time limit in seconds. 0 = no limit");
+    program.add_argument("--mem-limit")
+        .action([&](const auto& a) {config.mem_limit = std::atoll(a.c_str()) * 1024ULL * 1024ULL;})
+        .default_value(config.mem_limit)
+        .help("Memory limit in MB. Degrades, then stops SBVA as it is approached. 0 = no limit");
     program.add_argument("-m", "--maxreplace")
         .action([&](const auto& a) {config.max_replacements = std::atoi(a.c_str());})
         .default_value(config.max_replacements)
         .help("Maximum number of replacements to do. 0 = no limit");
+    program.add_argument("-t", "--threads")
+        .action([&](const auto& a) {config.num_threads = std::max(1, std::atoi(a.c_str()));})
+        .default_value(config.num_threads)
+        .help("Number of threads to use");
+    program.add_argument("--components")
+        .action([&](const auto&) {config.split_components = true;})
+        .flag()
+        .help("Run SBVA on each connected component separately, using all threads");
+    program.add_argument("--partitions")
+        .action([&](const auto& a) {config.partitions = std::atoi(a.c_str());})
+        .default_value(config.partitions)
+        .help("Split the formula into this many parts, reduce them in parallel, then the boundary. 0 = off");
+    program.add_argument("--speculate")
+        .action([&](const auto& a) {config.speculate = std::atoi(a.c_str());})
+        .default_value(config.speculate)
+        .help("Match this many queued literals at once, in parallel, and commit them in order. 0 = off");
+    program.add_argument("--rounds")
+        .action([&](const auto& a) {config.rounds = std::atoi(a.c_str());})
+        .default_value(config.rounds)
+        .help("Match this many queued literals per round, in parallel, and apply the non-overlapping replacements. 0 = off");
+    program.add_argument("--portfolio")
+        .action([&](const auto& a) {portfolio_spec = a;})
+        .help("Run these ';'-separated configurations in parallel on copies of the formula and keep the smallest result. "
+              "Each is a ','-separated list of: default, normal, clscutoff=N, litscutoff=N, steps=N, maxreplace=N");
+    program.add_argument("--portfolio-first")
+        .action([&](const auto&) {portfolio_first = true;})
+        .flag()
+        .help("Keep the first portfolio configuration to finish and cancel the others");
     program.add_argument("-n", "--normal")
         .action([&](const auto&) {tiebreak = Tiebreak::None;})
         .flag()
@@ -95,7 +270,6 @@ int main(int argc, char **argv) {
         .help("Preserve model count. Adds additional clauses but allows the tool to be used in propositional model ");
     program.add_argument("files").remaining().help("input file and output file");
 
-
     #if defined(__GNUC__) && defined(__linux__)
     feenableexcept(FE_INVALID   | FE_DIVBYZERO | FE_OVERFLOW);
     #endif
@@ -126,6 +300,24 @@ int main(int argc, char **argv) {
         exit(-1);
     }
 
+    Compression forced = NoCompression;
+    if (!compress.empty()) {
+        forced = compression_for("out." + compress);
+        if (forced == NoCompression) {
+            cerr << "Error: unknown compression '" << compress << "', use gz, xz or zst" << endl;
+            return 1;
+        }
+    }
+    config.cnf_compression = forced;
+    config.proof_compression = forced;
+    if (forced == NoCompression && !proof_fname.empty())
+        config.proof_compression = compression_for(proof_fname);
+
+    vector<PortfolioEntry> portfolio;
+    vector<string> portfolio_names;
+    if (!portfolio_spec.empty()
+        && !parse_portfolio(portfolio_spec, config, tiebreak, portfolio, portfolio_names)) return 1;
+
     FILE *fin = stdin;
     FILE *fout = stdout;
 
@@ -144,7 +336,7 @@ int main(int argc, char **argv) {
     auto my_time = cpuTime();
     if (!files.empty()) {
         const string in_fname = files[0];
-        fin = fopen(in_fname.c_str(), "r");
+        fin = fopen(in_fname.c_str(), "rb");
         if (fin == nullptr) {
             cerr << "Error: Could not open file " << in_fname << " for reading" << endl;
             return 1;
@@ -154,7 +346,9 @@ int main(int argc, char **argv) {
 
     if (files.size() >= 2) {
         const string out_fname = files[1];
-        fout = fopen(out_fname.c_str(), "w");
+        fout = fopen(out_fname.c_str(), "wb");
+        if (forced == NoCompression) config.cnf_compression = compression_for(out_fname);
+        if (binary_cnf_for(out_fname)) config.binary_cnf = true;
         if (fout == nullptr) {
             cerr << "Error: Could not open file " << out_fname << " for writing" << endl;
             return 1;
@@ -162,10 +356,16 @@ int main(int argc, char **argv) {
         cout << "c writing transformed CNF to file " << out_fname << endl;
     } else cout << "c writing transformed CNF to stdout..." << endl;
 
-    auto ret = run_bva(fin, fout, fproof, tiebreak, config);
+    Stats stats;
+    auto ret = run_bva(fin, fout, fproof, tiebreak, config, stats, convert, delta,
+                       portfolio, portfolio_names, portfolio_first);
+    const StopReason stop = stats.stop;
+    const bool timeout = stop == StopReason::StepLimit || stop == StopReason::TimeLimit
+        || stop == StopReason::CpuLimit || stop == StopReason::MemLimit;
     cout << "c SBVA Finished. Num vars now: " << ret.first << " num cls: " << ret.second << endl;
-    cout << "c steps remainK: " << std::setprecision(2) << std::fixed << (double)config.steps/1000.0
-           << " Timeout: " << (config.steps <= 0 ? "Yes" : "No")
+    cout << "c steps remainK: " << std::setprecision(2) << std::fixed << (double)stats.steps_left/1000.0
+           << " Timeout: " << (timeout ? "Yes" : "No")
+           << " Limit: " << stop_reason_str(stop)
            << " T: " << std::setprecision(2) << std::fixed
            << (cpuTime() - my_time)
            << endl;
@@ -0,0 +1,97 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+namespace SBVAImpl {
+
+// Runs fn(0) .. fn(num_threads-1) concurrently and waits for all of them.
+// The calling thread runs fn(0) itself.
+template<class Fn>
+void parallel_run(uint32_t num_threads, const Fn& fn) {
+    if (num_threads <= 1) {
+        fn(0);
+        return;
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    for (uint32_t t = 1; t < num_threads; t++) {
+        threads.emplace_back([&fn, t]() { fn(t); });
+    }
+    fn(0);
+    for (auto& th : threads) th.join();
+}
+
+// Bounded hand-over of items from a producer thread to a consumer. An empty
+// item marks the end of the stream. push() returns false once the consumer
+// has gone away, so the producer can stop early.
+template<class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t _max_items = 4) : max_items(_max_items) {}
+
+    bool push(T&& item) {
+        std::unique_lock<std::mutex> lock(mu);
+        not_full.wait(lock, [&] { return items.size() < max_items || closed; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    T pop() {
+        std::unique_lock<std::mutex> lock(mu);
+        not_empty.wait(lock, [&] { return !items.empty(); });
+        T item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return item;
+    }
+
+    // Makes the producer drop everything it still pushes.
+    void close() {
+        std::lock_guard<std::mutex> lock(mu);
+        closed = true;
+        items.clear();
+        not_full.notify_all();
+    }
+
+private:
+    size_t max_items;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mu;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+// Byte chunks, e.g. from a decompressor
+typedef BoundedQueue<std::vector<char>> ChunkQueue;
+
+}
@@ -0,0 +1,312 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+#include "compress.h"
+
+namespace SBVAImpl {
+
+// Block reader over a CNF input. The first bytes of the input decide whether
+// it is plain text or gzip/xz/zstd compressed. Compressed input is inflated
+// on a separate thread that hands chunks over through a bounded ChunkQueue,
+// so decompression overlaps with parsing and nothing touches the disk.
+class InputReader {
+public:
+    static const size_t chunk_size = 1 << 20;
+
+    explicit InputReader(FILE* _in) : in(_in) {
+        buf.resize(chunk_size);
+        len = fread(buf.data(), 1, chunk_size, in);
+        codec = detect_codec((const unsigned char*)buf.data(), len);
+        if (codec == Codec::Plain) return;
+
+        if (!codec_supported(codec)) {
+            fprintf(stderr, "Error: input is %s compressed, but SBVA was built without %s support\n",
+                codec_name(codec), codec_name(codec));
+            exit(1);
+        }
+        std::vector<char> prefix(buf.begin(), buf.begin() + len);
+        len = 0;
+        worker = std::thread([this, prefix]() { decompress(prefix); });
+    }
+
+    ~InputReader() {
+        if (worker.joinable()) {
+            queue.close();
+            worker.join();
+        }
+    }
+
+    InputReader(const InputReader&) = delete;
+    InputReader& operator=(const InputReader&) = delete;
+
+    Codec get_codec() const { return codec; }
+
+    // True if the rest of the input starts with the n bytes at s. Nothing
+    // is consumed.
+    bool starts_with(const char* s, size_t n) {
+        while (len - pos < n && fill()) {}
+        return len - pos >= n && memcmp(buf.data() + pos, s, n) == 0;
+    }
+
+    // Appends the rest of the input to out.
+    void read_all(std::vector<char>& out) {
+        do {
+            out.insert(out.end(), buf.data() + pos, buf.data() + len);
+            pos = len;
+        } while (fill());
+    }
+
+    // Hands out the buffered input up to its last complete line, or the
+    // remainder at the end of the input. Returns false once everything has
+    // been handed out. The block stays valid until the next call.
+    bool next_block(const char*& start, size_t& n) {
+        while (true) {
+            size_t end = len;
+            while (end > pos && buf[end - 1] != '\n') end--;
+            if (end > pos) {
+                start = buf.data() + pos;
+                n = end - pos;
+                pos = end;
+                return true;
+            }
+            if (!fill()) {
+                // last line without a newline
+                if (pos == len) return false;
+                start = buf.data() + pos;
+                n = len - pos;
+                pos = len;
+                return true;
+            }
+        }
+    }
+
+private:
+    // Appends more input after the unconsumed part of buf. Returns false at
+    // the end of the input.
+    bool fill() {
+        if (eof) return false;
+        if (pos > 0) {
+            memmove(buf.data(), buf.data() + pos, len - pos);
+            len -= pos;
+            pos = 0;
+        }
+        if (codec == Codec::Plain) {
+            if (buf.size() - len < chunk_size / 2) buf.resize(buf.size() * 2);
+            const size_t got = fread(buf.data() + len, 1, buf.size() - len, in);
+            len += got;
+            if (got == 0) eof = true;
+            return got != 0;
+        }
+
+        std::vector<char> chunk = queue.pop();
+        if (chunk.empty()) {
+            eof = true;
+            worker.join();
+            if (failed) {
+                fprintf(stderr, "Error: could not decompress %s input\n", codec_name(codec));
+                exit(1);
+            }
+            return false;
+        }
+        if (buf.size() - len < chunk.size()) buf.resize(len + chunk.size());
+        memcpy(buf.data() + len, chunk.data(), chunk.size());
+        len += chunk.size();
+        return true;
+    }
+
+    // Runs on the worker thread. prefix holds the bytes already read from
+    // the input for codec detection.
+    void decompress(const std::vector<char>& prefix) {
+        switch (codec) {
+#ifdef USE_ZLIB
+            case Codec::Gzip: failed = !inflate_gzip(prefix); break;
+#endif
+#ifdef USE_LZMA
+            case Codec::Xz: failed = !inflate_xz(prefix); break;
+#endif
+#ifdef USE_ZSTD
+            case Codec::Zstd: failed = !inflate_zstd(prefix); break;
+#endif
+            default: failed = true; break;
+        }
+        queue.push(std::vector<char>());
+    }
+
+    // Reads the next piece of compressed input into raw, returns its size.
+    size_t read_compressed(const std::vector<char>& prefix, bool& prefix_used, std::vector<char>& raw) {
+        if (!prefix_used) {
+            prefix_used = true;
+            raw = prefix;
+            return raw.size();
+        }
+        raw.resize(chunk_size);
+        const size_t got = fread(raw.data(), 1, raw.size(), in);
+        raw.resize(got);
+        return got;
+    }
+
+#ifdef USE_ZLIB
+    bool inflate_gzip(const std::vector<char>& prefix) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // 15 window bits + 32: detect gzip or zlib header
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) return false;
+
+        std::vector<char> raw;
+        bool prefix_used = false;
+        std::vector<char> out(chunk_size);
+        bool ok = true;
+        bool done = false;
+        while (ok && !done) {
+            if (zs.avail_in == 0) {
+                if (read_compressed(prefix, prefix_used, raw) == 0) {
+                    ok = false; // truncated stream
+                    break;
+                }
+                zs.next_in = (Bytef*)raw.data();
+                zs.avail_in = (uInt)raw.size();
+            }
+            zs.next_out = (Bytef*)out.data();
+            zs.avail_out = (uInt)out.size();
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END) ok = false;
+            const size_t produced = out.size() - zs.avail_out;
+            if (produced > 0) {
+                out.resize(produced);
+                if (!queue.push(std::move(out))) break;
+                out = std::vector<char>(chunk_size);
+            }
+            if (ret == Z_STREAM_END) {
+                // concatenated gzip members continue the same stream
+                if (zs.avail_in == 0 && read_compressed(prefix, prefix_used, raw) != 0) {
+                    zs.next_in = (Bytef*)raw.data();
+                    zs.avail_in = (uInt)raw.size();
+                }
+                if (zs.avail_in == 0) done = true;
+                else if (inflateReset(&zs) != Z_OK) ok = false;
+            }
+        }
+        inflateEnd(&zs);
+        return ok;
+    }
+#endif
+
+#ifdef USE_LZMA
+    bool inflate_xz(const std::vector<char>& prefix) {
+        lzma_stream ls = LZMA_STREAM_INIT;
+        if (lzma_stream_decoder(&ls, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) return false;
+
+        std::vector<char> raw;
+        bool prefix_used = false;
+        std::vector<char> out(chunk_size);
+        lzma_action action = LZMA_RUN;
+        bool ok = true;
+        while (true) {
+            if (ls.avail_in == 0 && action == LZMA_RUN) {
+                if (read_compressed(prefix, prefix_used, raw) == 0) action = LZMA_FINISH;
+                ls.next_in = (const uint8_t*)raw.data();
+                ls.avail_in = raw.size();
+            }
+            ls.next_out = (uint8_t*)out.data();
+            ls.avail_out = out.size();
+            lzma_ret ret = lzma_code(&ls, action);
+            const size_t produced = out.size() - ls.avail_out;
+            if (produced > 0) {
+                out.resize(produced);
+                if (!queue.push(std::move(out))) break;
+                out = std::vector<char>(chunk_size);
+            }
+            if (ret == LZMA_STREAM_END) break;
+            if (ret != LZMA_OK) {
+                ok = false;
+                break;
+            }
+        }
+        lzma_end(&ls);
+        return ok;
+    }
+#endif
+
+#ifdef USE_ZSTD
+    bool inflate_zstd(const std::vector<char>& prefix) {
+        ZSTD_DStream* zs = ZSTD_createDStream();
+        if (zs == nullptr) return false;
+        ZSTD_initDStream(zs);
+
+        std::vector<char> raw;
+        bool prefix_used = false;
+        std::vector<char> out(chunk_size);
+        size_t last_ret = 0;
+        bool ok = true;
+        bool closed = false;
+        while (ok && !closed && read_compressed(prefix, prefix_used, raw) != 0) {
+            ZSTD_inBuffer input = {raw.data(), raw.size(), 0};
+            // keep going while the output fills up, the decoder may still
+            // hold data after all input is consumed
+            bool out_full = false;
+            while (input.pos < input.size || out_full) {
+                ZSTD_outBuffer output = {out.data(), out.size(), 0};
+                last_ret = ZSTD_decompressStream(zs, &output, &input);
+                if (ZSTD_isError(last_ret)) {
+                    ok = false;
+                    break;
+                }
+                out_full = output.pos == output.size;
+                if (output.pos > 0) {
+                    out.resize(output.pos);
+                    if (!queue.push(std::move(out))) {
+                        closed = true;
+                        break;
+                    }
+                    out = std::vector<char>(chunk_size);
+                }
+            }
+        }
+        ZSTD_freeDStream(zs);
+        // a non-zero hint means the last frame was cut short
+        return ok && (closed || last_ret == 0);
+    }
+#endif
+
+    FILE* in;
+    Codec codec = Codec::Plain;
+    std::vector<char> buf;
+    size_t pos = 0;
+    size_t len = 0;
+    bool eof = false;
+
+    std::thread worker;
+    ChunkQueue queue;
+    bool failed = false; // written by worker before its final push
+};
+
+}
@@ -29,9 +29,16 @@ THE SOFTWARE.
 #include <vector>
 #include <algorithm>
 #include <unordered_set>
+#include <unordered_map>
 #include <tuple>
 #include <set>
 #include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <functional>
 
 #include <cstdio>
 #include <utility>
@@ -40,12 +47,26 @@ THE SOFTWARE.
 #include "murmur.h"
 #include "sbva.h"
 #include "GitSHA1.hpp"
-#include "getline.h"
+#include "binary_cnf.h"
+#include "cow_vector.h"
+#include "dimacs.h"
+#include "reader.h"
+#include "time_mem.h"
+#include "writer.h"
 
 using namespace std;
 
 namespace SBVAImpl {
 
+static Codec codec_for(SBVA::Compression c) {
+    switch (c) {
+        case SBVA::GzipCompression: return Codec::Gzip;
+        case SBVA::XzCompression: return Codec::Xz;
+        case SBVA::ZstdCompression: return Codec::Zstd;
+        default: return Codec::Plain;
+    }
+}
+
 struct Clause {
     bool deleted;
     vector<int> lits;
@@ -55,7 +76,7 @@ struct Clause {
         deleted = false;
     }
 
-    void print(const std::string extra = "") {
+    void print(const std::string extra = "") const {
         if (deleted) {
             cout << extra << "DELETED: ";
         } else cout << extra;
@@ -84,14 +105,108 @@ struct Clause {
 };
 
 
-struct ProofClause {
-    bool is_addition;
-    vector<int> lits;
+// Emits DRAT lines as replacements happen, in text or binary DRAT. With a
+// file attached, lines are formatted into a large buffer that is written out
+// whenever it fills up, so proof memory stays constant. Without one (library
+// users that only call to_proof() after the run) they are kept as a flat
+// list of literals.
+class ProofWriter {
+public:
+    ~ProofWriter() {
+        delete out;
+    }
+
+    void set_file(FILE* f) {
+        delete out;
+        out = new BufferedWriter(f, codec);
+    }
+
+    void set_binary(bool _binary) {
+        binary = _binary;
+    }
+
+    void set_codec(Codec _codec) {
+        codec = _codec;
+    }
+
+    void add(const int* lits, size_t num) {
+        emit(false, lits, num);
+    }
+
+    void del(const int* lits, size_t num) {
+        emit(true, lits, num);
+    }
+
+    // Writes out everything that is not yet in the attached file.
+    void flush() {
+        if (out != nullptr) out->flush();
+    }
+
+    // Formats the in-memory lines into fproof and forgets them.
+    void write_pending(FILE* fproof) {
+        flush();
+        BufferedWriter w(fproof, codec);
+        for_each_pending([&](bool is_del, const int* lits, size_t num) {
+            format(w, is_del, lits, num);
+        });
+        vector<int>().swap(pending);
+    }
+
+    size_t mem_used() const {
+        return (out ? out->capacity() : 0) + pending.capacity() * sizeof(int);
+    }
+
+    // Calls fn(is_del, lits, num) for each line kept in memory
+    template<class Fn>
+    void for_each_pending(const Fn& fn) const {
+        for (size_t i = 0; i < pending.size();) {
+            const bool is_del = pending[i++];
+            const size_t start = i;
+            while (pending[i] != 0) i++;
+            fn(is_del, pending.data() + start, i - start);
+            i++;
+        }
+    }
+
+private:
+    void emit(bool is_del, const int* lits, size_t num) {
+        if (out == nullptr) {
+            pending.push_back(is_del);
+            pending.insert(pending.end(), lits, lits + num);
+            pending.push_back(0);
+            return;
+        }
+        format(*out, is_del, lits, num);
+    }
+
+    void format(BufferedWriter& w, bool is_del, const int* lits, size_t num) const {
+        if (binary) {
+            format_binary(w, is_del, lits, num);
+            return;
+        }
+        if (is_del) w.put("d ", 2);
+        w.put_clause(lits, num);
+    }
 
-    ProofClause(bool _is_addition, vector<int> _lits) {
-        this->is_addition = _is_addition;
-        this->lits = _lits;
+    // Binary DRAT: 'a' or 'd', then each literal mapped to 2*var+sign as a
+    // little-endian base-128 varint, then a 0 byte.
+    static void format_binary(BufferedWriter& w, bool is_del, const int* lits, size_t num) {
+        w.put(is_del ? 'd' : 'a');
+        for (size_t i = 0; i < num; i++) {
+            uint32_t u = lits[i] < 0 ? 2 * -(uint32_t)lits[i] + 1 : 2 * (uint32_t)lits[i];
+            while (u > 127) {
+                w.put((char)((u & 127) | 128));
+                u >>= 7;
+            }
+            w.put((char)u);
+        }
+        w.put((char)0);
     }
+
+    BufferedWriter* out = nullptr;
+    bool binary = false;
+    Codec codec = Codec::Plain;
+    vector<int> pending; // (is_del, lits..., 0)*, used when out is not set
 };
 
 
@@ -137,7 +252,40 @@ public:
         delete cache;
     }
 
-    Formula(SBVA::Config& _config) : config(_config) { }
+    Formula(const SBVA::Config& _config) :
+        config(_config), steps_budget(_config.steps), rss_limit(_config.mem_limit)
+    {
+        start_wall = chrono::steady_clock::now();
+        start_cpu = cpuTime();
+    }
+
+    // A copy of a finished formula to be run under _config. Clauses,
+    // occurrences and adjacency rows stay shared with other until written.
+    // The proof starts empty and time limits keep counting from when other
+    // started parsing.
+    Formula(const Formula& other, const SBVA::Config& _config) :
+        found_header(other.found_header),
+        num_vars(other.num_vars),
+        num_clauses(other.num_clauses),
+        curr_clause(other.curr_clause),
+        num_input_clauses(other.num_input_clauses),
+        adj_deleted(other.adj_deleted),
+        clauses(other.clauses),
+        config(_config),
+        steps_budget(_config.steps),
+        lit_to_clauses(other.lit_to_clauses),
+        lit_count_adjust(other.lit_count_adjust),
+        adjacency_matrix_width(other.adjacency_matrix_width),
+        adjacency_matrix(other.adjacency_matrix),
+        start_wall(other.start_wall),
+        start_cpu(other.start_cpu),
+        lits_stored(other.lits_stored),
+        occs_stored(other.occs_stored),
+        adj_nonzeros(other.adj_nonzeros),
+        rss_limit(_config.mem_limit)
+    {
+        assert(other.cache == nullptr);
+    }
 
     void init_cnf(uint32_t _num_vars) {
         num_vars = _num_vars;
@@ -167,117 +315,419 @@ public:
         }
 
         sort(clauses[(curr_clause)].lits.begin(), clauses[(curr_clause)].lits.end());
+        index_clause();
+        num_clauses = curr_clause;
+    }
+
+    // Adds all clauses of a flat buffer of 0-terminated clauses. Storage is
+    // reserved up front and the occurrence lists are built in one pass at the
+    // end, each grown once to its final size.
+    void add_clauses(const int* lits, size_t n) {
+        assert(found_header);
+        if (n > 0 && lits[n-1] != 0) {
+            fprintf(stderr, "Error: the last clause passed to add_clauses is not terminated by 0\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if ((uint32_t)abs(lits[i]) > num_vars) {
+                fprintf(stderr, "Error: CNF file has a variable that is greater than the number of variables specified in the header\n");
+                exit(1);
+            }
+        }
+        const size_t num_new = std::count(lits, lits + n, 0);
+        clauses.reserve(clauses.size() + num_new);
+        cache->clauses.reserve(cache->clauses.size() + num_new);
+
+        const size_t first = store_clauses(lits, n);
+        vector<uint32_t> occ_count(num_vars * 2, 0);
+        for (size_t i = first; i < curr_clause; i++) {
+            if (clauses[(i)].deleted) continue;
+            for (auto l : clauses[(i)].lits) occ_count[lit_index(l)]++;
+        }
+        for (size_t l = 0; l < occ_count.size(); l++) {
+            if (occ_count[l] != 0) lit_to_clauses[l].reserve(lit_to_clauses[l].size() + occ_count[l]);
+        }
+        index_clauses(first, curr_clause, config.steps);
+        num_clauses = curr_clause;
+    }
+
+    // Stores the 0-terminated clauses in lits from curr_clause on, sorted,
+    // with duplicates marked deleted. Returns the index of the first one.
+    // Their occurrences are left to index_clauses().
+    size_t store_clauses(const int* lits, size_t n) {
+        const size_t first = curr_clause;
+        const int* end = lits + n;
+        for (const int* p = lits; p < end;) {
+            const int* cl_end = std::find(p, end, 0);
+            if (curr_clause == clauses.size()) clauses.push_back(Clause());
+            auto *cls = &clauses[(curr_clause)];
+            cls->lits.assign(p, cl_end);
+            config.steps -= cls->lits.size();
+            sort(cls->lits.begin(), cls->lits.end());
+
+            lits_stored += cls->lits.size();
+            if (cache->contains(cls)) {
+                cls->deleted = true;
+                adj_deleted++;
+            } else {
+                cache->add(cls);
+                occs_stored += cls->lits.size();
+            }
+            curr_clause++;
+            p = cl_end + 1;
+        }
+        return first;
+    }
+
+    // Records the occurrences of the live clauses in [from, to).
+    void index_clauses(size_t from, size_t to, int64_t& steps) {
+        for (size_t i = from; i < to; i++) {
+            if (clauses[(i)].deleted) continue;
+            for (auto l : clauses[(i)].lits) {
+                steps--;
+                lit_to_clauses[lit_index(l)].push_back(i);
+            }
+        }
+    }
 
+    // Marks the sorted clause at curr_clause deleted if it is a duplicate,
+    // otherwise records its occurrences, then moves on to the next clause.
+    // Without a cache the clauses are known to be unique.
+    void index_clause() {
         auto *cls = &clauses[(curr_clause)];
-        if (cache->contains(cls)) {
+        lits_stored += cls->lits.size();
+        if (cache != nullptr && cache->contains(cls)) {
             cls->deleted = true;
             adj_deleted++;
         } else {
-            cache->add(cls);
+            if (cache != nullptr) cache->add(cls);
             for (auto l : clauses[(curr_clause)].lits) {
                 config.steps--;
                 lit_to_clauses[lit_index(l)].push_back(curr_clause);
             }
+            occs_stored += cls->lits.size();
         }
 
         curr_clause++;
-        num_clauses = curr_clause;
     }
 
     void finish_cnf() {
         delete cache;
         cache = nullptr;
-        for (size_t i=1; i<=num_vars; i++) {
-            update_adjacency_matrix(i);
-        }
+        num_input_clauses = num_clauses;
+        build_adjacency_matrix();
     }
 
     void read_cnf(FILE *fin) {
-        char *line = nullptr;
-        size_t len = 0;
+        {
+            // binary CNF in a regular file is decoded straight from the mapping
+            MappedFile mapped(fin);
+            if (is_binary_cnf(mapped.data(), mapped.size())) {
+                if (config.verbosity) cout << "c input is binary CNF" << endl;
+                read_binary_cnf(mapped.data(), mapped.size());
+                fseek(fin, 0, SEEK_END);
+                return;
+            }
+        }
+
+        InputReader reader(fin);
+        if (config.verbosity && reader.get_codec() != Codec::Plain)
+            cout << "c input is " << codec_name(reader.get_codec()) << " compressed" << endl;
+        if (reader.starts_with(binary_cnf_magic, sizeof(binary_cnf_magic))) {
+            if (config.verbosity) cout << "c input is binary CNF" << endl;
+            vector<char> data;
+            reader.read_all(data);
+            read_binary_cnf(data.data(), data.size());
+            return;
+        }
+
+        begin_dimacs();
+        if (config.num_threads > 1) {
+            read_dimacs_pipelined(reader);
+        } else {
+            DimacsTokenizer tokenizer;
+            vector<int> lits;
+            const char* block;
+            size_t n;
+            while (reader.next_block(block, n)) {
+                tokenizer.tokenize(block, block + n, lits);
+                add_dimacs(tokenizer, lits);
+            }
+            tokenizer.finish(lits);
+            add_dimacs(tokenizer, lits);
+        }
+        end_dimacs();
+    }
+
+    // Same as above for input that is already in memory, which is parsed in
+    // place, in blocks of whole lines as from a file, so that only one
+    // block's tokens are held at a time.
+    void read_cnf(const char* data, size_t len) {
+        if (is_binary_cnf(data, len)) {
+            if (config.verbosity) cout << "c input is binary CNF" << endl;
+            read_binary_cnf(data, len);
+            return;
+        }
+        if (detect_codec((const unsigned char*)data, len) != Codec::Plain) {
+            fprintf(stderr, "Error: compressed CNF can only be read from a file\n");
+            exit(1);
+        }
+        begin_dimacs();
+        DimacsTokenizer tokenizer;
+        vector<int> lits;
+        const size_t block_size = InputReader::chunk_size;
+        const char* const end = data + len;
+        for (const char* p = data; p < end;) {
+            const char* q = end;
+            if ((size_t)(end - p) > block_size) {
+                q = (const char*)memchr(p + block_size, '\n', end - p - block_size);
+                q = q ? q + 1 : end;
+            }
+            tokenizer.tokenize(p, q, lits);
+            add_dimacs(tokenizer, lits);
+            p = q;
+        }
+        tokenizer.finish(lits);
+        add_dimacs(tokenizer, lits);
+        end_dimacs();
+    }
 
+    void begin_dimacs() {
         assert(cache == nullptr);
         cache = new ClauseCache;
-
         curr_clause = 0;
-        while (getline2(&line, &len, fin) != -1) {
-            if (len == 0) {
-                continue;
-            }
-            if (line[0] == 'c') {
-                continue;
-            } else if (line[0] == 'p') {
-                sscanf(line, "p cnf %lu %lu", &num_vars, &num_clauses);
-                clauses.resize(num_clauses);
-                lit_to_clauses.resize(num_vars * 2);
-                lit_count_adjust.resize(num_vars * 2);
-                adjacency_matrix_width = num_vars * 4;
-                adjacency_matrix.resize(num_vars);
-                found_header = true;
-            } else {
-                if (!found_header) {
-                    fprintf(stderr, "Error: CNF file does not have a header\n");
-                    exit(1);
-                }
+    }
 
-                if (curr_clause >= num_clauses && line[0] == 0) {
-                    fprintf(stderr, "Error: CNF file has more clauses than specified in header\n");
-                    exit(1);
-                }
+    // Takes over the header once the tokenizer has seen it
+    void apply_header(uint64_t vars, uint64_t cls) {
+        num_vars = vars;
+        num_clauses = cls;
+        clauses.resize(num_clauses);
+        cache->clauses.reserve(num_clauses);
+        lit_to_clauses.resize(num_vars * 2);
+        lit_count_adjust.resize(num_vars * 2);
+        adjacency_matrix_width = num_vars * 4;
+        adjacency_matrix.resize(num_vars);
+        found_header = true;
+    }
 
-                int lit = 0;
-                char *curr = line;
-                while (sscanf(curr, "%d", &lit) > 0) {
-                    if (lit == 0) {
-                        break;
-                    }
-                    if ((uint32_t)abs(lit) > num_vars) {
-                        fprintf(stderr, "Error: CNF file has a variable that is greater than the number of variables specified in the header\n");
-                        exit(1);
-                    }
-                    config.steps--;
-                    clauses[(curr_clause)].lits.push_back(lit);
-                    curr = strchr(curr, ' ');
-                    curr++;
-                }
+    // Stores and indexes the tokenized clauses in lits, then clears it
+    void add_dimacs(const DimacsTokenizer& tokenizer, vector<int>& lits) {
+        if (!found_header && tokenizer.has_header())
+            apply_header(tokenizer.header_vars(), tokenizer.header_clauses());
+        const size_t first = store_clauses(lits.data(), lits.size());
+        index_clauses(first, curr_clause, config.steps);
+        lits.clear();
+    }
 
-                sort(clauses[(curr_clause)].lits.begin(), clauses[(curr_clause)].lits.end());
-
-                auto *cls = &clauses[(curr_clause)];
-                if (cache->contains(cls)) {
-                    cls->deleted = true;
-                    adj_deleted++;
-                } else {
-                    cache->add(cls);
-                    for (auto l : clauses[(curr_clause)].lits) {
-                        config.steps--;
-                        lit_to_clauses[lit_index(l)].push_back(curr_clause);
-                    }
+    // Tokenized DIMACS on its way from the tokenizer to sort/dedup
+    struct TokenBatch {
+        vector<int> lits;
+        bool header = false;
+        uint64_t vars = 0;
+        uint64_t cls = 0;
+        bool empty() const { return lits.empty() && !header; }
+    };
+
+    // Clauses [from, to) on their way from sort/dedup to the indexer
+    struct ClauseRange {
+        size_t from = 0;
+        size_t to = 0;
+        bool empty() const { return from == to; }
+    };
+
+    struct StageStats {
+        const char* name;
+        const char* unit;
+        double amount = 0;
+        double busy = 0;
+        double wait_in = 0;  // starved, waiting for the previous stage
+        double wait_out = 0; // blocked, waiting for the next stage
+    };
+
+    // Reading, tokenizing, sort/dedup and occurrence indexing run as a
+    // pipeline, each stage on its own thread (sort/dedup on this one),
+    // connected by bounded queues. Clauses pass through every stage in input
+    // order, so the result is the same as reading serially. The indexer only
+    // touches clauses the sort/dedup stage has handed over, and the clause
+    // vector is sized from the header before the first one is.
+    void read_dimacs_pipelined(InputReader& reader) {
+        typedef chrono::steady_clock clock;
+        auto secs = [](clock::time_point a, clock::time_point b) {
+            return chrono::duration<double>(b - a).count();
+        };
+        StageStats stats[4] = {{"read", "MB"}, {"tokenize", "MB"},
+                               {"sort/dedup", "Kcls"}, {"index", "Kcls"}};
+        BoundedQueue<vector<char>> blocks(4);
+        BoundedQueue<TokenBatch> batches(4);
+        BoundedQueue<ClauseRange> ranges(16);
+
+        std::thread read_thread([&]() {
+            StageStats& st = stats[0];
+            const char* block;
+            size_t n;
+            while (true) {
+                auto t0 = clock::now();
+                if (!reader.next_block(block, n)) break;
+                vector<char> copy(block, block + n);
+                auto t1 = clock::now();
+                blocks.push(std::move(copy));
+                auto t2 = clock::now();
+                st.amount += n / (1024.0 * 1024.0);
+                st.busy += secs(t0, t1);
+                st.wait_out += secs(t1, t2);
+            }
+            blocks.push(vector<char>());
+        });
+
+        std::thread tokenize_thread([&]() {
+            StageStats& st = stats[1];
+            DimacsTokenizer tokenizer;
+            bool header_sent = false;
+            while (true) {
+                auto t0 = clock::now();
+                vector<char> block = blocks.pop();
+                auto t1 = clock::now();
+                TokenBatch batch;
+                if (block.empty()) tokenizer.finish(batch.lits);
+                else tokenizer.tokenize(block.data(), block.data() + block.size(), batch.lits);
+                if (!header_sent && tokenizer.has_header()) {
+                    batch.header = header_sent = true;
+                    batch.vars = tokenizer.header_vars();
+                    batch.cls = tokenizer.header_clauses();
                 }
-
-                curr_clause++;
+                auto t2 = clock::now();
+                if (!batch.empty()) batches.push(std::move(batch));
+                auto t3 = clock::now();
+                st.amount += block.size() / (1024.0 * 1024.0);
+                st.wait_in += secs(t0, t1);
+                st.busy += secs(t1, t2);
+                st.wait_out += secs(t2, t3);
+                if (block.empty()) break;
             }
+            batches.push(TokenBatch());
+        });
+
+        int64_t index_steps = 0;
+        std::thread index_thread([&]() {
+            StageStats& st = stats[3];
+            while (true) {
+                auto t0 = clock::now();
+                ClauseRange r = ranges.pop();
+                auto t1 = clock::now();
+                if (r.empty()) break;
+                index_clauses(r.from, r.to, index_steps);
+                st.amount += (r.to - r.from) / 1000.0;
+                st.wait_in += secs(t0, t1);
+                st.busy += secs(t1, clock::now());
+            }
+        });
+
+        StageStats& st = stats[2];
+        while (true) {
+            auto t0 = clock::now();
+            TokenBatch batch = batches.pop();
+            auto t1 = clock::now();
+            if (batch.empty()) break;
+            if (batch.header) apply_header(batch.vars, batch.cls);
+            ClauseRange r;
+            r.from = store_clauses(batch.lits.data(), batch.lits.size());
+            r.to = curr_clause;
+            auto t2 = clock::now();
+            if (!r.empty()) ranges.push(std::move(r));
+            auto t3 = clock::now();
+            st.amount += (r.to - r.from) / 1000.0;
+            st.wait_in += secs(t0, t1);
+            st.busy += secs(t1, t2);
+            st.wait_out += secs(t2, t3);
         }
-        free(line);
-        delete cache;
-        cache = nullptr;
+        ranges.push(ClauseRange());
+
+        read_thread.join();
+        tokenize_thread.join();
+        index_thread.join();
+        config.steps += index_steps;
+
+        if (config.verbosity) {
+            for (const auto& s : stats) {
+                cout << "c ingest " << std::left << setw(10) << s.name << std::right
+                    << std::setprecision(2) << std::fixed
+                    << " " << setw(9) << s.amount << " " << setw(4) << s.unit
+                    << " busy " << setw(6) << s.busy << " s"
+                    << " (" << setw(9) << (s.busy > 0 ? s.amount / s.busy : 0) << " " << s.unit << "/s)"
+                    << " starved " << setw(6) << s.wait_in << " s"
+                    << " blocked " << setw(6) << s.wait_out << " s" << endl;
+            }
+        }
+    }
+
+    // A header that promised more clauses than there are is cut down to the
+    // real count.
+    void end_dimacs() {
+        if (curr_clause < num_clauses) {
+            clauses.resize(curr_clause);
+            num_clauses = curr_clause;
+        }
+        finish_cnf();
+    }
+
+    void read_binary_cnf(const char* data, size_t len) {
+        BinaryCnfView view;
+        if (!view.open(data, len)) {
+            fprintf(stderr, "Error: binary CNF is truncated or corrupt\n");
+            exit(1);
+        }
+        const BinaryCnfHeader& h = view.get_header();
+        num_vars = h.num_vars;
+        num_clauses = h.num_clauses;
+        clauses.resize(num_clauses);
+        lit_to_clauses.resize(num_vars * 2);
+        lit_count_adjust.resize(num_vars * 2);
+        adjacency_matrix_width = num_vars * 4;
+        adjacency_matrix.resize(num_vars);
+        found_header = true;
+
+        assert(cache == nullptr);
+        if (!(h.flags & binary_cnf_deduplicated)) cache = new ClauseCache;
 
-        for (size_t i=1; i<=num_vars; i++) {
-            update_adjacency_matrix(i);
+        curr_clause = 0;
+        for (size_t i = 0; i < num_clauses; i++) {
+            auto& lits = clauses[(curr_clause)].lits;
+            if (!view.clause(i, lits)) {
+                fprintf(stderr, "Error: binary CNF is truncated or corrupt\n");
+                exit(1);
+            }
+            for (int lit : lits) {
+                if (lit == 0 || (uint32_t)abs(lit) > num_vars) {
+                    fprintf(stderr, "Error: CNF file has a variable that is greater than the number of variables specified in the header\n");
+                    exit(1);
+                }
+            }
+            config.steps -= lits.size();
+            index_clause();
         }
+        finish_cnf();
     }
 
     void update_adjacency_matrix(int lit) {
         int abslit = std::abs(lit);
-        if (adjacency_matrix[sparsevec_lit_idx(abslit)].nonZeros() > 0) {
+        if (std::as_const(adjacency_matrix)[sparsevec_lit_idx(abslit)].nonZeros() > 0) {
             // use cached version
             return;
         }
+        Eigen::SparseVector<int> vec = adjacency_row(abslit, config.steps);
+        adj_nonzeros += vec.nonZeros();
+        adjacency_matrix[sparsevec_lit_idx(abslit)] = vec;
+    }
+
+    // Counts, for each literal, the live clauses it shares with abslit or
+    // -abslit. Only reads the clauses, so rows can be built concurrently.
+    Eigen::SparseVector<int> adjacency_row(int abslit, int64_t& steps) const {
         Eigen::SparseVector<int> vec(adjacency_matrix_width);
 
         for (int cid : lit_to_clauses[lit_index(abslit)]) {
-            config.steps--;
-            Clause *cls = &clauses[cid];
+            steps--;
+            const Clause *cls = &clauses[cid];
             if (cls->deleted) continue;
             for (int v : cls->lits) {
                 vec.coeffRef(sparsevec_lit_idx(v)) += 1;
@@ -285,15 +735,53 @@ public:
         }
 
         for (int cid : lit_to_clauses[lit_index(-abslit)]) {
-            config.steps--;
-            Clause *cls = &clauses[cid];
+            steps--;
+            const Clause *cls = &clauses[cid];
             if (cls->deleted) continue;
             for (int v : cls->lits) {
                 vec.coeffRef(sparsevec_lit_idx(v)) += 1;
             }
         }
+        return vec;
+    }
 
-        adjacency_matrix[sparsevec_lit_idx(abslit)] = vec;
+    // Fills the missing adjacency rows of vars, or of all variables, split
+    // over the threads by variable
+    void build_adjacency_matrix(const vector<int>* vars = nullptr) {
+        const uint32_t num_threads = config.num_threads;
+        const size_t n = vars ? vars->size() : num_vars;
+        auto var_at = [&](size_t i) { return vars ? (*vars)[i] : (int)(i + 1); };
+        if (num_threads <= 1) {
+            for (size_t i=0; i<n; i++) {
+                update_adjacency_matrix(var_at(i));
+            }
+            return;
+        }
+        // rows shared with a clone are copied here, not by the threads
+        for (size_t i = 0; i < n; i++) adjacency_matrix.unshare(sparsevec_lit_idx(var_at(i)));
+        vector<int64_t> steps(num_threads, 0);
+        vector<size_t> nonzeros(num_threads, 0);
+        parallel_run(num_threads, [&](uint32_t t) {
+            for (size_t i = t; i < n; i += num_threads) {
+                const int v = var_at(i);
+                auto& row = adjacency_matrix[sparsevec_lit_idx(v)];
+                if (row.nonZeros() > 0) continue;
+                Eigen::SparseVector<int> vec = adjacency_row(v, steps[t]);
+                nonzeros[t] += vec.nonZeros();
+                row.swap(vec);
+            }
+        });
+        for (uint32_t t = 0; t < num_threads; t++) {
+            config.steps += steps[t];
+            adj_nonzeros += nonzeros[t];
+        }
+    }
+
+    // Frees all cached adjacency rows, they are rebuilt on demand.
+    void drop_adjacency_cache() {
+        adjacency_matrix.clear();
+        adjacency_matrix.resize(num_vars);
+        adj_nonzeros = 0;
     }
 
     int tiebreaking_heuristic(int lit1, int lit2) {
@@ -305,63 +793,269 @@ public:
         update_adjacency_matrix(lit1);
         update_adjacency_matrix(lit2);
 
-        auto& vec1 = adjacency_matrix[sparsevec_lit_idx(abs1)];
-        auto& vec2 = adjacency_matrix[sparsevec_lit_idx(abs2)];
+        // Rows are only read here, so reading them must not copy chunks
+        // shared with a clone. A built row never changes, but the update
+        // of another row may move it to a copy of its chunk, so rows are
+        // looked up again after each update.
+        const auto& rows = std::as_const(adjacency_matrix);
+        const uint32_t idx1 = sparsevec_lit_idx(abs1);
+        const uint32_t idx2 = sparsevec_lit_idx(abs2);
+        const Eigen::Index nonzeros = rows[idx2].nonZeros();
 
         int total_count = 0;
-        for (int *var_ptr = vec2.innerIndexPtr(); var_ptr < vec2.innerIndexPtr() + vec2.nonZeros(); var_ptr++) {
+        for (Eigen::Index k = 0; k < nonzeros; k++) {
             config.steps--;
-            int var = sparcevec_lit_for_idx(*var_ptr);
-            int count = vec2.coeffRef(sparsevec_lit_idx(var));
+            const auto& vec2 = rows[idx2];
+            int var = sparcevec_lit_for_idx(vec2.innerIndexPtr()[k]);
+            int count = vec2.valuePtr()[k];
             update_adjacency_matrix(var);
-            auto& vec3 = adjacency_matrix[sparsevec_lit_idx(var)];
-            total_count += count * vec3.dot(vec1);
+            total_count += count * rows[sparsevec_lit_idx(var)].dot(rows[idx1]);
         }
         tmp_heuristic_cache_full[sparsevec_lit_idx(lit2)] = total_count;
         return total_count;
     }
 
-    auto to_cnf(FILE *fout) {
-        fprintf(fout, "p cnf %lu %lu\n", num_vars, num_clauses - adj_deleted);
+    // Tie counts from which score_ties() scores on all threads
+    static const size_t parallel_ties_min = 16;
+
+    // tiebreaking_heuristic(lit, ties[i]) for all ties. With several
+    // threads, the rows the scores read are built first (the same rows, and
+    // the same steps, as scoring one by one), then the uncached ties are
+    // scored concurrently against the now read-only adjacency cache.
+    void score_ties(int lit, const vector<int>& ties, vector<int>& scores) {
+        scores.resize(ties.size());
+        const uint32_t num_threads = config.num_threads;
+        if (num_threads <= 1 || ties.size() < parallel_ties_min) {
+            for (size_t i = 0; i < ties.size(); i++) {
+                scores[i] = tiebreaking_heuristic(lit, ties[i]);
+            }
+            return;
+        }
+
+        // ties sharing a variable share a score, only the first is computed
+        vector<size_t> todo;
+        vector<int> rows;
+        rows.push_back(std::abs(lit));
+        for (size_t i = 0; i < ties.size(); i++) {
+            const uint32_t idx = sparsevec_lit_idx(ties[i]);
+            if (tmp_heuristic_cache_full.count(idx)) continue;
+            bool first = true;
+            for (size_t j : todo) {
+                if (sparsevec_lit_idx(ties[j]) == idx) first = false;
+            }
+            if (!first) continue;
+            todo.push_back(i);
+            rows.push_back(std::abs(ties[i]));
+        }
+        if (todo.empty()) {
+            for (size_t i = 0; i < ties.size(); i++) {
+                scores[i] = tmp_heuristic_cache_full[sparsevec_lit_idx(ties[i])];
+            }
+            return;
+        }
+        auto build_rows = [&]() {
+            sort(rows.begin(), rows.end());
+            rows.erase(unique(rows.begin(), rows.end()), rows.end());
+            build_adjacency_matrix(&rows);
+        };
+        build_rows();
+        rows.clear();
+        for (size_t i : todo) {
+            const auto& vec2 = std::as_const(adjacency_matrix)[sparsevec_lit_idx(ties[i])];
+            for (Eigen::SparseVector<int>::InnerIterator it(vec2); it; ++it) {
+                rows.push_back(sparcevec_lit_for_idx(it.index()));
+            }
+        }
+        build_rows();
+
+        const auto& rows_read = adjacency_matrix; // no copy-on-write in the threads
+        const auto& vec1 = rows_read[sparsevec_lit_idx(lit)];
+        vector<int> totals(todo.size());
+        const uint32_t n = std::min<size_t>(num_threads, todo.size());
+        vector<int64_t> steps(n, 0);
+        parallel_run(n, [&](uint32_t t) {
+            for (size_t k = t; k < todo.size(); k += n) {
+                const auto& vec2 = rows_read[sparsevec_lit_idx(ties[todo[k]])];
+                int total_count = 0;
+                for (Eigen::SparseVector<int>::InnerIterator it(vec2); it; ++it) {
+                    steps[t]--;
+                    const auto& vec3 = rows_read[it.index()];
+                    total_count += it.value() * vec3.dot(vec1);
+                }
+                totals[k] = total_count;
+            }
+        });
+        for (size_t k = 0; k < todo.size(); k++) {
+            tmp_heuristic_cache_full[sparsevec_lit_idx(ties[todo[k]])] = totals[k];
+        }
+        for (int64_t st : steps) config.steps += st;
+        for (size_t i = 0; i < ties.size(); i++) {
+            scores[i] = tmp_heuristic_cache_full[sparsevec_lit_idx(ties[i])];
+        }
+    }
+
+    auto to_cnf(FILE *fout) const {
+        if (config.binary_cnf) return to_binary_cnf(fout);
+        BufferedWriter w(fout, codec_for(config.cnf_compression));
+        w.put("p cnf ", 6);
+        w.put_uint(num_vars);
+        w.put(' ');
+        w.put_uint(num_clauses - adj_deleted);
+        w.put('\n');
+        if (config.num_threads > 1 && num_clauses > (1 << 16)) {
+            w.flush();
+            write_parallel(fout, num_clauses, config.num_threads,
+                [&](size_t i, ChunkBuffer& b) {
+                    const Clause& cl = clauses[i];
+                    if (!cl.deleted) b.put_clause(cl.lits.data(), cl.lits.size());
+                }, w.compressor());
+            return std::make_pair(num_vars, num_clauses-adj_deleted);
+        }
         for (size_t i = 0; i < num_clauses; i++) {
             if (clauses[(i)].deleted) {
                 continue;
             }
-            for (int lit : clauses[(i)].lits) {
-                fprintf(fout, "%d ", lit);
-            }
-            fprintf(fout, "0\n");
+            w.put_clause(clauses[(i)].lits.data(), clauses[(i)].lits.size());
+        }
+        return std::make_pair(num_vars, num_clauses-adj_deleted);
+    }
+
+    // Live clauses are sorted and unique, so the file is flagged deduplicated.
+    std::pair<size_t, size_t> to_binary_cnf(FILE *fout) const {
+        vector<uint64_t> offsets;
+        offsets.reserve(num_clauses - adj_deleted + 1);
+        uint64_t num_lits = 0;
+        uint64_t body_size = 0;
+        vector<char> rec;
+        for (size_t i = 0; i < num_clauses; i++) {
+            const Clause& cl = clauses[i];
+            if (cl.deleted) continue;
+            rec.resize(max_clause_record(cl.lits.size()));
+            offsets.push_back(body_size);
+            body_size += encode_clause(cl.lits.data(), cl.lits.size(), rec.data()) - rec.data();
+            num_lits += cl.lits.size();
+        }
+        offsets.push_back(body_size);
+
+        const bool narrow = body_size <= UINT32_MAX;
+        BufferedWriter w(fout, codec_for(config.cnf_compression));
+        char tmp[8];
+        w.put(binary_cnf_magic, sizeof(binary_cnf_magic));
+        for (uint64_t v : {(uint64_t)num_vars, (uint64_t)(num_clauses - adj_deleted), num_lits,
+                           binary_cnf_deduplicated | (narrow ? binary_cnf_offsets32 : 0)}) {
+            w.put(tmp, put_u64(v, tmp) - tmp);
+        }
+        for (uint64_t off : offsets) {
+            w.put(tmp, (narrow ? put_u32((uint32_t)off, tmp) : put_u64(off, tmp)) - tmp);
+        }
+        for (size_t i = 0; i < num_clauses; i++) {
+            const Clause& cl = clauses[i];
+            if (cl.deleted) continue;
+            rec.resize(max_clause_record(cl.lits.size()));
+            w.put(rec.data(), encode_clause(cl.lits.data(), cl.lits.size(), rec.data()) - rec.data());
+        }
+        return std::make_pair(num_vars, num_clauses-adj_deleted);
+    }
+
+    SBVA::Delta get_delta() const {
+        SBVA::Delta delta;
+        delta.num_vars = num_vars;
+        for (size_t i = 0; i < num_input_clauses; i++) {
+            if (clauses[i].deleted) delta.removed.push_back(i);
+        }
+        for (size_t i = num_input_clauses; i < num_clauses; i++) {
+            if (clauses[i].deleted) continue;
+            delta.added.insert(delta.added.end(), clauses[i].lits.begin(), clauses[i].lits.end());
+            delta.added.push_back(0);
+            delta.num_added++;
+        }
+        return delta;
+    }
+
+    // "p delta <vars> <removed> <added>", a "d <index>" line per removed
+    // input clause, then the added clauses.
+    auto to_delta(FILE *fout) const {
+        size_t num_removed = 0;
+        size_t num_added = 0;
+        for (size_t i = 0; i < num_clauses; i++) {
+            if (!clauses[i].deleted) num_added += i >= num_input_clauses;
+            else num_removed += i < num_input_clauses;
+        }
+
+        BufferedWriter w(fout, codec_for(config.cnf_compression));
+        w.put("p delta ", 8);
+        w.put_uint(num_vars);
+        w.put(' ');
+        w.put_uint(num_removed);
+        w.put(' ');
+        w.put_uint(num_added);
+        w.put('\n');
+        for (size_t i = 0; i < num_input_clauses; i++) {
+            if (!clauses[i].deleted) continue;
+            w.put("d ", 2);
+            w.put_uint(i);
+            w.put('\n');
+        }
+        for (size_t i = num_input_clauses; i < num_clauses; i++) {
+            if (clauses[i].deleted) continue;
+            w.put_clause(clauses[i].lits.data(), clauses[i].lits.size());
         }
         return std::make_pair(num_vars, num_clauses-adj_deleted);
     }
 
-    vector<int> get_cnf(uint32_t& ret_num_vars, uint32_t& ret_num_cls) {
+    vector<int> get_cnf(uint32_t& ret_num_vars, uint32_t& ret_num_cls) const {
         vector<int> ret;
+        ret.resize(count_lits(ret_num_vars, ret_num_cls) + ret_num_cls);
+        get_cnf(ret.data(), ret.size());
+        return ret;
+    }
+
+    uint64_t count_lits(uint32_t& ret_num_vars, uint32_t& ret_num_cls) const {
         ret_num_cls = num_clauses - adj_deleted;
         ret_num_vars = num_vars;
+        uint64_t num_lits = 0;
         for (size_t i = 0; i < num_clauses; i++) {
-            if (clauses[(i)].deleted) continue;
-            for (int lit : clauses[(i)].lits) {
-                ret.push_back(lit);
-            }
-            ret.push_back(0);
+            if (!clauses[(i)].deleted) num_lits += clauses[(i)].lits.size();
         }
-        return ret;
+        return num_lits;
     }
 
-    void to_proof(FILE *fproof) {
-        for (const auto & clause : proof) {
-            if (!clause.is_addition) {
-                fprintf(fproof, "d ");
-            }
-            for (int lit : clause.lits) {
-                fprintf(fproof, "%d ", lit);
+    uint64_t get_cnf(int* buf, uint64_t buf_len) const {
+        int* pos = buf;
+        int* end = buf + buf_len;
+        for (size_t i = 0; i < num_clauses; i++) {
+            const Clause& cl = clauses[(i)];
+            if (cl.deleted) continue;
+            if ((uint64_t)(end - pos) < cl.lits.size() + 1) {
+                fprintf(stderr, "Error: buffer passed to get_cnf is too small\n");
+                exit(1);
             }
-            fprintf(fproof, "0\n");
+            pos = std::copy(cl.lits.begin(), cl.lits.end(), pos);
+            *pos++ = 0;
+        }
+        return pos - buf;
+    }
+
+    void for_each_clause(const std::function<void(const int*, size_t)>& fn) const {
+        for (size_t i = 0; i < num_clauses; i++) {
+            const Clause& cl = clauses[(i)];
+            if (!cl.deleted) fn(cl.lits.data(), cl.lits.size());
         }
     }
 
-    int least_frequent_not(Clause *clause, int var) {
+    void stream_proof(FILE *fproof) {
+        proof.set_binary(config.proof_binary);
+        proof.set_codec(codec_for(config.proof_compression));
+        proof.set_file(fproof);
+    }
+
+    void to_proof(FILE *fproof) {
+        proof.set_binary(config.proof_binary);
+        proof.set_codec(codec_for(config.proof_compression));
+        proof.write_pending(fproof);
+    }
+
+    int least_frequent_not(const Clause *clause, int var) const {
         int lmin = 0;
         int lmin_count = 0;
         for (auto lit : clause->lits) {
@@ -377,20 +1071,21 @@ public:
         return lmin;
     }
 
-    int real_lit_count(int lit) {
+    int real_lit_count(int lit) const {
         return lit_to_clauses[lit_index(lit)].size() + lit_count_adjust[lit_index(lit)];
     }
 
     // Performs partial clause difference between clause and other, storing the result in diff.
     // Only the first max_diff literals are stored in diff.
     // Requires that clause and other are sorted.
-    void clause_sub(Clause *clause, Clause *other, vector<int>& diff, uint32_t max_diff) {
+    void clause_sub(const Clause *clause, const Clause *other, vector<int>& diff, uint32_t max_diff,
+            int64_t& steps) const {
         diff.resize(0);
         size_t idx_a = 0;
         size_t idx_b = 0;
 
         while (idx_a < clause->lits.size() && idx_b < other->lits.size() && diff.size() <= max_diff) {
-            config.steps--;
+            steps--;
             if (clause->lits[idx_a] == other->lits[idx_b]) {
                 idx_a++;
                 idx_b++;
@@ -408,529 +1103,1592 @@ public:
         }
     }
 
-    void run_sbva(SBVA::Tiebreak tiebreak_mode) {
-        struct PairOp {
-            bool operator()(const pair<int, int> &a, const pair<int, int> &b) {
-                return a.first < b.first;
+    // Polls the wall-clock and CPU-time limits. The wall clock is read
+    // without entering the kernel, so it is checked on every call. The CPU
+    // time takes a getrusage() syscall, so only every 128th call reads it.
+    bool time_limit_hit() {
+        if (config.time_limit > 0) {
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - start_wall;
+            if (elapsed.count() >= config.time_limit) {
+                stop_reason = SBVA::TimeLimit;
+                return true;
             }
-        };
+        }
+        if (config.cpu_limit <= 0 || (++limit_polls & 127) != 0) return false;
+        if (cpuTime() - start_cpu >= config.cpu_limit) {
+            stop_reason = SBVA::CpuLimit;
+            return true;
+        }
+        return false;
+    }
+
+    // Estimated heap footprint of the clause store, occurrence lists,
+    // adjacency cache and in-memory proof, in bytes. Each clause and
+    // occurrence list is a heap block of its own, with the allocator's
+    // header and rounding, and occurrence lists grow by doubling, so they
+    // are half empty on average.
+    size_t mem_footprint() const {
+        typedef Eigen::SparseVector<int>::StorageIndex AdjIndex;
+        const size_t block_overhead = 16;
+        size_t bytes = clauses.capacity() * sizeof(Clause) + lits_stored * sizeof(int);
+        bytes += lit_to_clauses.capacity() * sizeof(vector<int>) + occs_stored * sizeof(int) * 3 / 2;
+        bytes += (clauses.size() + lit_to_clauses.size()) * block_overhead;
+        bytes += adjacency_matrix.capacity() * sizeof(Eigen::SparseVector<int>);
+        bytes += adj_nonzeros * (sizeof(int) + sizeof(AdjIndex));
+        bytes += proof.mem_used();
+        return bytes;
+    }
 
-        // The priority queue keeps track of all the literals to evaluate for replacements.
-        // Each entry is the pair (num_clauses, lit)
-        priority_queue<pair<int,int>, vector< pair<int,int> >, PairOp> pq;
+    // Memory in use as the stages see it: the process RSS at its last read
+    // plus what the footprint changed by since. It follows what the process
+    // really uses, so the stages come before the stop at the limit, and it
+    // drops as soon as the adjacency cache is freed. The RSS itself does not
+    // drop then, but stages only ever go up, so that can only bring on the
+    // next stage, not undo one. Parts of run_parts() share the process with
+    // others and only count their own footprint.
+    uint64_t mem_estimate() const {
+        const uint64_t fp = mem_footprint();
+        if (!mem_from_rss || last_rss + fp < footprint_at_rss) return fp;
+        return std::max<uint64_t>(fp, last_rss + fp - footprint_at_rss);
+    }
 
-        // Add all of the variables from the original formula to the priority queue.
-        for (size_t i = 1; i <= num_vars; i++) {
-            pq.push(make_pair(real_lit_count(i), i));
-            pq.push(make_pair(real_lit_count(-i), -i));
+    // Polls the memory budget and degrades in stages as mem_estimate() fills
+    // it up: first the adjacency cache is dropped, then the ThreeHop
+    // tie-break (which rebuilds it) is turned off, and at the limit itself we
+    // stop. The RSS is only read every 16th poll as it goes through /proc.
+    // Polls every 128th call, starting with the first.
+    bool mem_limit_hit(SBVA::Tiebreak& tiebreak_mode) {
+        if (config.mem_limit == 0) return false;
+        const uint32_t poll = mem_polls++;
+        if ((poll & 127) != 0) return false;
+
+        if (((poll >> 7) & 15) == 0) {
+            double vm_usage;
+            last_rss = memUsedTotal(vm_usage);
+            footprint_at_rss = mem_footprint();
         }
+        const uint64_t used = mem_estimate();
+        mem_used = used;
 
-        vector<int> matched_lits;
-        vector<int>* matched_clauses(new vector<int>());
-        vector<int> *matched_clauses_swap(new vector<int>());
-        vector<int> *matched_clauses_id( new vector<int>());
-        vector<int> *matched_clauses_id_swap(new vector<int>());
-        matched_lits.reserve(10000);
-        matched_clauses->reserve(10000);
-        matched_clauses_swap->reserve(10000);
-        matched_clauses_id->reserve(10000);
-        matched_clauses_id_swap->reserve(10000);
-
-        // Track the index of the matched clauses from every literal that is added to matched_lits.
-        vector< tuple<int, int> > clauses_to_remove;
+        if (used >= config.mem_limit || last_rss >= rss_limit) {
+            stop_reason = SBVA::MemLimit;
+            return true;
+        }
+        if (mem_stage < 2 && used >= config.mem_limit / 10 * 9) {
+            if (config.verbosity)
+                cout << "c memory at " << used/(1024*1024) << " MB, switching to plain BVA tie-break" << endl;
+            mem_stage = 2;
+            tiebreak_mode = SBVA::Tiebreak::None;
+            drop_adjacency_cache();
+        } else if (mem_stage < 1 && used >= config.mem_limit / 4 * 3) {
+            if (config.verbosity)
+                cout << "c memory at " << used/(1024*1024) << " MB, dropping adjacency cache" << endl;
+            mem_stage = 1;
+            drop_adjacency_cache();
+        }
+        return false;
+    }
 
-        // Used for computing clause differences
-        vector<int> diff;
+    SBVA::StopReason get_stop_reason() const { return stop_reason; }
+
+    SBVA::Stats get_stats() const {
+        SBVA::Stats st;
+        st.stop = stop_reason;
+        st.num_vars = num_vars;
+        st.num_clauses = num_clauses - adj_deleted;
+        st.replacements = replacements;
+        st.steps_used = steps_budget - config.steps;
+        st.steps_left = config.steps;
+        st.time = run_time;
+        st.mem_used = mem_used;
+        st.mem_stage = mem_stage;
+        if (running) st.time += chrono::duration<double>(chrono::steady_clock::now() - run_start).count();
+        return st;
+    }
 
-        // Keep track of the matrix of swaps that we can perform.
-        // Each entry is of the form (literal, <clause index>, <index in matched_clauses>)
-        //
-        // For example, given the formula:
-        // (A v E)  (A v F)  (A v G)  (A v H)
-        // (B v E)  (B v F)  (B v G)  (B v H)
-        // (C v E)  (C v F)           (C v H)
-        // (D v E)  (D v F)
-        //
-        // We would start with the following matrix:
-        // matched_entries:     (A, (A v E), 0)  (A, (A v F), 1)  (A, (A v G), 2)  (A, (A v H), 3)
-        // matched_clauses_id:  0  1  2  3
-        // matched_clauses:     (A v E)  (A v F)  (A v G)  (A v H)
-        //
-        // Then, when we add B to matched_lits, we would get:
-        // matched_entries:     (A, (A v E), 0)  (A, (A v F), 1)  (A, (A v G), 2)  (A, (A v H), 3)
-        //                      (B, (B v E), 0)  (B, (B v F), 1)  (B, (B v G), 2)  (B, (B v H), 3)
-        // matched_clauses_id:  0  1  2  3
-        // matched_clauses:     (A v E)  (A v F)  (A v G)  (A v H)
-        //
-        // Then, when we add C to matched_lits, we would get:
-        // matched_entries:     (A, (A v E), 0)  (A, (A v F), 1)  (A, (A v G), 2)  (A, (A v H), 3)
-        //                      (B, (B v E), 0)  (B, (B v F), 1)  (B, (B v G), 2)  (B, (B v H), 3)
-        //                      (C, (C v E), 0)  (C, (C v F), 1)                   (C, (C v H), 3)
-        // matched_clauses_id:  0  1  3
-        // matched_clauses:     (A v E)  (A v F)  (A v H)
-        //
-        // Adding D to matched_lits would not result in a reduction so we stop here.
-        //
-        // The matched_clauses_id is then used as a filter to find the clauses to remove:
-        //
-        // to_remove:   (A v E)  (A v F)  (A v H)
-        //              (B v E)  (B v F)  (B v H)
-        //              (C v E)  (C v F)  (C v H)
-        //
-        vector< tuple<int, int, int> > matched_entries;
+    struct PairOp {
+        bool operator()(const pair<int, int> &a, const pair<int, int> &b) {
+            return a.first < b.first;
+        }
+    };
 
-        // Keep a list of the literals that are matched so we can sort and count later.
-        vector<int> matched_entries_lits;
+    // The priority queue keeps track of all the literals to evaluate for replacements.
+    // Each entry is the pair (num_clauses, lit)
+    typedef priority_queue<pair<int,int>, vector< pair<int,int> >, PairOp> LitQueue;
 
-        // Used for priority queue updates.
-        unordered_set<int> lits_to_update;
+    // What the matching phase found for one literal, with its scratch space.
+    struct Match {
+        int var = 0;
+        vector<int> lits;       // Mlit
+        vector<int> clauses;    // Mcls
+        vector<int> clauses_id; // index in F[var] of each clause in Mcls
 
-        // Track number of replacements (new auxiliary variables).
-        size_t num_replacements = 0;
+        // Track the index of the matched clauses from every literal that is added to matched_lits.
+        vector< tuple<int, int> > to_remove;
 
+        vector<int> clauses_swap;
+        vector<int> clauses_id_swap;
+        vector< tuple<int, int, int> > entries;
+        vector<int> entries_lits;
+        vector<int> diff;
+        vector<int> ties;
+        vector<int> scores;
+    };
+
+    // A queue entry evaluated ahead of its turn in speculative mode.
+    struct Speculation {
+        pair<int, int> entry;
+        Match m;
+        int64_t steps = 0;
+        vector<int> read_vars; // the evaluation depends on the clauses of these
+        map<int, int> heuristic_cache;
+        unordered_map<int, Eigen::SparseVector<int>> rows; // adjacency rows built, by variable
+    };
+
+    struct SpeculationState {
+        vector<Speculation> batch;
+        vector<uint32_t> changed; // per variable, the last batch that touched it
+        uint32_t epoch = 0;
+        size_t batches = 0;
+        size_t evaluated = 0;
+        size_t reevaluated = 0;
+        double match_time = 0; // seconds in the parallel part
+        double commit_time = 0;
+    };
+
+    // What run_sbva() keeps between calls, so that a run stopped by a slice
+    // or a limit goes on where it left off
+    struct Engine {
+        bool active = false; // once the queue runs empty, the next run starts over
+        LitQueue pq;
+        Match m;
+        unordered_set<int> lits_to_update; // used for priority queue updates
+        size_t num_replacements = 0; // new auxiliary variables of this run
+        SpeculationState spec;
+        SBVA::Tiebreak tiebreak_mode = SBVA::ThreeHop; // mem_limit_hit() may turn it off
+    };
+
+    // Mcls sizes from which find_match() splits the foreach C in Mcls scan
+    // over the threads; below it, starting threads costs more than the scan
+    static const size_t parallel_scan_min = 2048;
+
+    // The foreach C in Mcls scan of find_match() over Mcls[from, to),
+    // appending to entries and entries_lits. Only reads the formula.
+    void scan_clauses(int var, const Match& m, size_t from, size_t to,
+            vector< tuple<int, int, int> >& entries, vector<int>& entries_lits,
+            vector<int>& diff, int64_t& steps, int verbosity) const {
+        for (size_t i = from; i < to; i++) {
+            steps--;
+            int clause_idx = m.clauses[(i)];
+            int clause_id = m.clauses_id[(i)];
+            const Clause *clause = &clauses[(clause_idx)];
+
+            if (verbosity >= 3) {
+                cout << "  Clause " << clause_idx << " (" << clause_id << "): ";
+                clause->print();
+            }
 
-        while (!pq.empty()) {
-            // check timeout
-            if (config.steps < 0 ) {
-                if (config.verbosity)
-                    cout << "c stopping SBVA due to timeout. time remainK: "
-                        << std::setprecision(2) << std::fixed << config.steps/1000.0 << endl;
-                delete matched_clauses;
-                delete matched_clauses_swap;
-                delete matched_clauses_id;
-                delete matched_clauses_id_swap;
-                return;
+            // let lmin in (C \ {l}) be least occuring in F
+            int lmin = least_frequent_not(clause, var);
+            if (lmin == 0) {
+                continue;
             }
-            if (config.verbosity >= 2)
-                cout << "c time remainK: "
-                    << std::setprecision(2) << std::fixed << config.steps/1000.0 << endl;
 
-            // check replacement limit
-            if (config.max_replacements != 0 && num_replacements == config.max_replacements) {
-                if (config.verbosity) {
-                    cout << "Hit replacement limit (" << config.max_replacements << ")" << endl;
+            // foreach D in F[lmin]
+            for (auto other_idx : lit_to_clauses[lit_index(lmin)]) {
+                steps--;
+                const Clause *other = &clauses[(other_idx)];
+                if (other->deleted) {
+                    continue;
                 }
-                delete matched_clauses;
-                delete matched_clauses_swap;
-                delete matched_clauses_id;
-                delete matched_clauses_id_swap;
-                return;
-            }
 
-            matched_lits.clear();
-            matched_clauses->clear();
-            matched_clauses_id->clear();
-            clauses_to_remove.clear();
-            tmp_heuristic_cache_full.clear();
+                if (clause->lits.size() != other->lits.size()) {
+                    continue;
+                }
 
-            // Get the next literal to evaluate.
-            pair<int, int> p = pq.top();
-            pq.pop();
+                // diff := C \ D (limited to 2)
+                clause_sub(clause, other, diff, 2, steps);
 
-            int var = p.second;
-            int num_matched = p.first;
+                // if diff = {l} then
+                if (diff.size() == 1 && diff[0] == var) {
+                    // diff := D \ C (limited to 2)
+                    clause_sub(other, clause, diff, 2, steps);
 
-            if (num_matched == 0 || num_matched != real_lit_count(var)) {
-                continue;
+                    // if diff = {lmin} then
+                    auto lit = diff[0];
+
+                    // TODO: potential performance improvement
+                    bool found = false;
+                    for (auto l : m.lits) {
+                        if (l == lit) {
+                            found = true;
+                            break;
+                        }
+                    }
+
+                    // if lit not in Mlit then
+                    if (!found) {
+                        // Add to clause match matrix.
+                        entries.push_back(make_tuple(lit, other_idx, i));
+                        entries_lits.push_back(lit);
+                    }
+                }
             }
+        }
+    }
 
-            if (config.verbosity) {
-                cout << "Trying " << var << " (" << num_matched << ")" << endl;
+    // scan_clauses() with Mcls split into one contiguous range per thread.
+    // Each thread fills its own buffers, which are appended in range order,
+    // so entries, entries_lits and steps come out as in a serial scan.
+    void scan_clauses_parallel(int var, Match& m, int64_t& steps, uint32_t num_threads) const {
+        struct Range {
+            vector< tuple<int, int, int> > entries;
+            vector<int> entries_lits;
+            vector<int> diff;
+            int64_t steps = 0;
+        };
+        vector<Range> ranges(num_threads);
+        const size_t n = m.clauses.size();
+        parallel_run(num_threads, [&](uint32_t t) {
+            Range& r = ranges[t];
+            scan_clauses(var, m, n * t / num_threads, n * (t + 1) / num_threads,
+                r.entries, r.entries_lits, r.diff, r.steps, 0);
+        });
+        for (const Range& r : ranges) {
+            steps += r.steps;
+            m.entries.insert(m.entries.end(), r.entries.begin(), r.entries.end());
+            m.entries_lits.insert(m.entries_lits.end(), r.entries_lits.begin(), r.entries_lits.end());
+        }
+    }
+
+    // Grows Mlit and Mcls for var, the matching phase of SBVA. It only reads
+    // the formula: ties are scored by heuristic(var, ties, scores) and the
+    // work is charged to steps, so several literals can be matched at once.
+    //
+    // Keep track of the matrix of swaps that we can perform.
+    // Each entry is of the form (literal, <clause index>, <index in matched_clauses>)
+    //
+    // For example, given the formula:
+    // (A v E)  (A v F)  (A v G)  (A v H)
+    // (B v E)  (B v F)  (B v G)  (B v H)
+    // (C v E)  (C v F)           (C v H)
+    // (D v E)  (D v F)
+    //
+    // We would start with the following matrix:
+    // matched_entries:     (A, (A v E), 0)  (A, (A v F), 1)  (A, (A v G), 2)  (A, (A v H), 3)
+    // matched_clauses_id:  0  1  2  3
+    // matched_clauses:     (A v E)  (A v F)  (A v G)  (A v H)
+    //
+    // Then, when we add B to matched_lits, we would get:
+    // matched_entries:     (A, (A v E), 0)  (A, (A v F), 1)  (A, (A v G), 2)  (A, (A v H), 3)
+    //                      (B, (B v E), 0)  (B, (B v F), 1)  (B, (B v G), 2)  (B, (B v H), 3)
+    // matched_clauses_id:  0  1  2  3
+    // matched_clauses:     (A v E)  (A v F)  (A v G)  (A v H)
+    //
+    // Then, when we add C to matched_lits, we would get:
+    // matched_entries:     (A, (A v E), 0)  (A, (A v F), 1)  (A, (A v G), 2)  (A, (A v H), 3)
+    //                      (B, (B v E), 0)  (B, (B v F), 1)  (B, (B v G), 2)  (B, (B v H), 3)
+    //                      (C, (C v E), 0)  (C, (C v F), 1)                   (C, (C v H), 3)
+    // matched_clauses_id:  0  1  3
+    // matched_clauses:     (A v E)  (A v F)  (A v H)
+    //
+    // Adding D to matched_lits would not result in a reduction so we stop here.
+    //
+    // The matched_clauses_id is then used as a filter to find the clauses to remove:
+    //
+    // to_remove:   (A v E)  (A v F)  (A v H)
+    //              (B v E)  (B v F)  (B v H)
+    //              (C v E)  (C v F)  (C v H)
+    //
+    template<class Heuristic>
+    void find_match(int var, Match& m, int64_t& steps, SBVA::Tiebreak tiebreak_mode,
+            Heuristic&& heuristic, int verbosity, uint32_t num_threads = 1) const {
+        m.var = var;
+        m.lits.clear();
+        m.clauses.clear();
+        m.clauses_id.clear();
+        m.to_remove.clear();
+
+        // Mlit := { l }
+        m.lits.push_back(var);
+
+        // Mcls := F[l]
+        for (size_t i = 0; i < lit_to_clauses[lit_index(var)].size(); i++) {
+            steps--;
+            int clause_idx = lit_to_clauses[lit_index(var)][i];
+            if (!clauses[(clause_idx)].deleted) {
+                m.clauses.push_back(clause_idx);
+                m.clauses_id.push_back(i);
+                m.to_remove.push_back(make_tuple(clause_idx, i));
             }
+        }
 
-            // Mlit := { l }
-            matched_lits.push_back(var);
+        while (1) {
+            // P = {}
+            m.entries.clear();
+            m.entries_lits.clear();
 
-            // Mcls := F[l]
-            for (size_t i = 0; i < lit_to_clauses[lit_index(var)].size(); i++) {
-                config.steps--;
-                int clause_idx = lit_to_clauses[lit_index(var)][i];
-                if (!clauses[(clause_idx)].deleted) {
-                    matched_clauses->push_back(clause_idx);
-                    matched_clauses_id->push_back(i);
-                    clauses_to_remove.push_back(make_tuple(clause_idx, i));
+            if (verbosity) {
+                cout << "Iteration, Mlit: ";
+                for (int matched_lit : m.lits) {
+                    cout << matched_lit << " ";
                 }
+                cout << endl;
             }
 
-            while (1) {
-                // P = {}
-                matched_entries.clear();
-                matched_entries_lits.clear();
+            // foreach C in Mcls
+            if (num_threads > 1 && verbosity < 3 && m.clauses.size() >= parallel_scan_min) {
+                scan_clauses_parallel(var, m, steps, num_threads);
+            } else {
+                scan_clauses(var, m, 0, m.clauses.size(), m.entries, m.entries_lits, m.diff, steps, verbosity);
+            }
 
-                if (config.verbosity) {
-                    cout << "Iteration, Mlit: ";
-                    for (int matched_lit : matched_lits) {
-                        cout << matched_lit << " ";
-                    }
-                    cout << endl;
-                }
+            // lmax := most frequent literal in P
 
-                // foreach C in Mcls
-                for (size_t i = 0; i < matched_clauses->size(); i++) {
-                    config.steps--;
-                    int clause_idx = (*matched_clauses)[(i)];
-                    int clause_id = (*matched_clauses_id)[(i)];
-                    auto *clause = &clauses[(clause_idx)];
+            steps -= m.entries_lits.size();
+            sort(m.entries_lits.begin(), m.entries_lits.end());
 
-                    if (config.verbosity >= 3) {
-                        cout << "  Clause " << clause_idx << " (" << clause_id << "): ";
-                        clause->print();
-                    }
+            int lmax = 0;
+            int lmax_count = 0;
 
-                    // let lmin in (C \ {l}) be least occuring in F
-                    int lmin = least_frequent_not(clause, var);
-                    if (lmin == 0) {
-                        continue;
-                    }
+            m.ties.clear();
+            for (size_t i2 = 0; i2 < m.entries_lits.size();) {
+                int lit = m.entries_lits[i2];
+                int count = 0;
 
-                    // foreach D in F[lmin]
-                    for (auto other_idx : lit_to_clauses[lit_index(lmin)]) {
-                        config.steps--;
-                        auto *other = &clauses[(other_idx)];
-                        if (other->deleted) {
-                            continue;
-                        }
+                while (i2 < m.entries_lits.size() && m.entries_lits[i2] == lit) {
+                    steps--;
+                    count++;
+                    i2++;
+                }
 
-                        if (clause->lits.size() != other->lits.size()) {
-                            continue;
-                        }
+                if (verbosity >= 3) {
+                    cout << "  " << lit << " count: " << count << endl;
+                }
 
-                        // diff := C \ D (limited to 2)
-                        clause_sub(clause, other, diff, 2);
-
-                        // if diff = {l} then
-                        if (diff.size() == 1 && diff[0] == var) {
-                            // diff := D \ C (limited to 2)
-                            clause_sub(other, clause, diff, 2);
-
-                            // if diff = {lmin} then
-                            auto lit = diff[0];
-
-                            // TODO: potential performance improvement
-                            bool found = false;
-                            for (auto l : matched_lits) {
-                                if (l == lit) {
-                                    found = true;
-                                    break;
-                                }
-                            }
-
-                            // if lit not in Mlit then
-                            if (!found) {
-                                // Add to clause match matrix.
-                                matched_entries.push_back(make_tuple(lit, other_idx, i));
-                                matched_entries_lits.push_back(lit);
-                            }
-                        }
-                    }
+                if (count > lmax_count) {
+                    lmax = lit;
+                    lmax_count = count;
+                    m.ties.clear();
+                    m.ties.push_back(lit);
+                } else if (count == lmax_count) {
+                    m.ties.push_back(lit);
                 }
+            }
 
-                // lmax := most frequent literal in P
+            if (lmax == 0) {
+                break;
+            }
 
-                config.steps-= matched_entries_lits.size();
-                sort(matched_entries_lits.begin(), matched_entries_lits.end());
+            int prev_clause_count = m.clauses.size();
+            int new_clause_count = lmax_count;
 
-                int lmax = 0;
-                int lmax_count = 0;
+            int prev_lit_count = m.lits.size();
+            int new_lit_count = prev_lit_count + 1;
 
-                std::vector<int> ties;
-                ties.reserve(16);
-                for (size_t i2 = 0; i2 < matched_entries_lits.size();) {
-                    int lit = matched_entries_lits[i2];
-                    int count = 0;
+            // if adding lmax to Mlit does not result in a reduction then stop
+            int current_reduction = reduction(prev_lit_count, prev_clause_count);
+            int new_reduction = reduction(new_lit_count, new_clause_count);
 
-                    while (i2 < matched_entries_lits.size() && matched_entries_lits[i2] == lit) {
-                        config.steps--;
-                        count++;
-                        i2++;
-                    }
+            if (verbosity) {
+                cout << "  lmax: " << lmax << " (" << lmax_count << ")" << endl;
+                cout << "  current_reduction: " << current_reduction << endl;
+                cout << "  new_reduction: " << new_reduction << endl;
+            }
 
-                    if (config.verbosity >= 3) {
-                        cout << "  " << lit << " count: " << count << endl;
-                    }
+            if (new_reduction <= current_reduction) {
+                break;
+            }
 
-                    if (count > lmax_count) {
-                        lmax = lit;
-                        lmax_count = count;
-                        ties.clear();
-                        ties.push_back(lit);
-                    } else if (count == lmax_count) {
-                        ties.push_back(lit);
+            // Break ties
+            if (m.ties.size() > 1 && tiebreak_mode == SBVA::Tiebreak::ThreeHop) {
+                heuristic(var, m.ties, m.scores);
+                int max_heuristic_val = m.scores[0];
+                for (size_t i=1; i<m.ties.size(); i++) {
+                    steps--;
+                    int h = m.scores[i];
+                    if (h > max_heuristic_val) {
+                        max_heuristic_val = h;
+                        lmax = m.ties[i];
                     }
                 }
+            }
 
-                if (lmax == 0) {
-                    break;
-                }
 
-                int prev_clause_count = matched_clauses->size();
-                int new_clause_count = lmax_count;
+            // Mlit := Mlit U {lmax}
+            m.lits.push_back(lmax);
 
-                int prev_lit_count = matched_lits.size();
-                int new_lit_count = prev_lit_count + 1;
+            // Mcls := Mcls U P[lmax]
+            m.clauses_swap.resize(lmax_count);
+            m.clauses_id_swap.resize(lmax_count);
 
-                // if adding lmax to Mlit does not result in a reduction then stop
-                int current_reduction = reduction(prev_lit_count, prev_clause_count);
-                int new_reduction = reduction(new_lit_count, new_clause_count);
+            int insert_idx = 0;
+            for (const auto& pair : m.entries) {
+                steps--;
+                int lit = get<0>(pair);
+                if (lit != lmax) continue;
 
-                if (config.verbosity) {
-                    cout << "  lmax: " << lmax << " (" << lmax_count << ")" << endl;
-                    cout << "  current_reduction: " << current_reduction << endl;
-                    cout << "  new_reduction: " << new_reduction << endl;
-                }
+                int clause_idx = get<1>(pair);
+                int idx = get<2>(pair);
 
-                if (new_reduction <= current_reduction) {
-                    break;
-                }
+                m.clauses_swap[(insert_idx)] = m.clauses[(idx)];
+                m.clauses_id_swap[(insert_idx)] = m.clauses_id[(idx)];
+                insert_idx += 1;
 
-                // Break ties
-                if (ties.size() > 1 && tiebreak_mode == SBVA::Tiebreak::ThreeHop) {
-                    int max_heuristic_val = tiebreaking_heuristic(var, ties[0]);
-                    for (size_t i=1; i<ties.size(); i++) {
-                        config.steps--;
-                        int h = tiebreaking_heuristic(var, ties[i]);
-                        if (h > max_heuristic_val) {
-                            max_heuristic_val = h;
-                            lmax = ties[i];
-                        }
-                    }
-                }
+                m.to_remove.push_back(make_tuple(clause_idx, m.clauses_id[(idx)]));
+            }
 
+            swap(m.clauses, m.clauses_swap);
+            swap(m.clauses_id, m.clauses_id_swap);
 
-                // Mlit := Mlit U {lmax}
-                matched_lits.push_back(lmax);
+            if (verbosity) {
+                cout << "  Mcls: ";
+                for (int matched_clause : m.clauses) {
+                    cout << matched_clause << " ";
+                }
+                cout << endl;
+                cout << "  Mcls_id: ";
+                for (int i : m.clauses_id) {
+                    cout << i << " ";
+                }
+                cout << endl;
+            }
+        }
+    }
 
-                // Mcls := Mcls U P[lmax]
-                matched_clauses_swap->resize(lmax_count);
-                matched_clauses_id_swap->resize(lmax_count);
+    bool worth_replacing(const Match& m) const {
+        if (m.lits.size() == 1) {
+            return false;
+        }
+        return !(m.lits.size() <= config.matched_lits_cutoff &&
+                m.clauses.size() <= config.matched_cls_cutoff);
+    }
 
-                int insert_idx = 0;
-                for (const auto& pair : matched_entries) {
-                    config.steps--;
-                    int lit = get<0>(pair);
-                    if (lit != lmax) continue;
+    // Replaces the clauses of m with the new variable's clauses and queues
+    // the literals whose counts changed. lits_to_update is left holding the
+    // literals of the removed clauses.
+    void apply_match(const Match& m, LitQueue& pq, unordered_set<int>& lits_to_update) {
+        const int var = m.var;
+        int matched_clause_count = m.clauses.size();
+        int matched_lit_count = m.lits.size();
+
+        if (config.verbosity) {
+            cout << "  mlits: ";
+            for (int matched_lit : m.lits) {
+                cout << matched_lit << " ";
+            }
+            cout << endl;
+            cout << "  mclauses:\n";
+            for (int matched_clause : m.clauses) {
+                clauses[matched_clause].print("   -> ");
+            }
+            cout << endl;
 
-                    int clause_idx = get<1>(pair);
-                    int idx = get<2>(pair);
+            cout << "--------------------" << endl;
+        }
+        assert(lit_to_clauses.size() == num_vars*2);
+        assert(lit_count_adjust.size() == num_vars*2);
+
+        // Do the substitution
+        num_vars += 1;
+        replacements++;
+        int new_var = num_vars;
+
+        // Prepare to add new clauses.
+        uint32_t new_sz = num_clauses + matched_lit_count + matched_clause_count +
+            (config.preserve_model_cnt ? 1 : 0);
+        clauses.resize(new_sz);
+
+        lit_to_clauses.resize(lit_to_clauses.size() + 2);
+        lit_count_adjust.resize(lit_count_adjust.size() + 2);
+        if (sparsevec_lit_idx(new_var) >= adjacency_matrix_width) {
+            // The vectors must be constructed with a fixed, pre-determined width.
+            //
+            // This is quite an annoying limitation, as it means we have to re-construct
+            // all the vectors if we go above the width limit
+            adjacency_matrix_width = num_vars * 2;
+            adjacency_matrix.clear();
+            adj_nonzeros = 0;
+        }
+        adjacency_matrix.resize(num_vars);
 
-                    (*matched_clauses_swap)[(insert_idx)] = (*matched_clauses)[(idx)];
-                    (*matched_clauses_id_swap)[(insert_idx)] = (*matched_clauses_id)[(idx)];
-                    insert_idx += 1;
+        // Add (f, lit) clauses.
+        for (int i = 0; i < matched_lit_count; ++i) {
+            config.steps--;
+            int lit = m.lits[(i)];
+            int new_clause = num_clauses + i;
+
+            auto cls = Clause();
+            cls.lits.push_back(lit);
+            cls.lits.push_back(new_var); // new_var is always largest value
+            (clauses)[new_clause] = cls;
+
+            lit_to_clauses[lit_index(lit)].push_back(new_clause);
+            lit_to_clauses[lit_index(new_var)].push_back(new_clause);
+            lits_stored += 2;
+            occs_stored += 2;
+
+            if (config.generate_proof) {
+                const int proof_lits[2] = {new_var, lit}; // new_var needs to be first for proof
+                proof.add(proof_lits, 2);
+            }
+        }
 
-                    clauses_to_remove.push_back(make_tuple(clause_idx, (*matched_clauses_id)[(idx)]));
+        // Add (-f, ...) clauses.
+        for (int i = 0; i < matched_clause_count; ++i) {
+            config.steps--;
+            int clause_idx = m.clauses[i];
+            auto new_clause = num_clauses + matched_lit_count + i;
+
+            auto cls = Clause();
+            cls.lits.push_back(-new_var); // -new_var is always smallest value
+            lit_to_clauses[lit_index(-new_var)].push_back(new_clause);
+
+            const auto& match_cls = clauses[(clause_idx)];
+            for (auto mlit : match_cls.lits) {
+                if (mlit != var) {
+                    cls.lits.push_back(mlit);
+                    lit_to_clauses[lit_index(mlit)].push_back(new_clause);
                 }
+            }
+            lits_stored += cls.lits.size();
+            occs_stored += cls.lits.size();
+            clauses[new_clause] = std::move(cls);
 
-                swap(matched_clauses,matched_clauses_swap);
-                swap(matched_clauses_id,matched_clauses_id_swap);
+            if (config.generate_proof) {
+                const auto& lits = clauses[new_clause].lits;
+                proof.add(lits.data(), lits.size());
+            }
+        }
 
-                if (config.verbosity) {
-                    cout << "  Mcls: ";
-                    for (int matched_clause : (*matched_clauses)) {
-                        cout << matched_clause << " ";
-                    }
-                    cout << endl;
-                    cout << "  Mcls_id: ";
-                    for (int i : (*matched_clauses_id)) {
-                        cout << i << " ";
-                    }
-                    cout << endl;
-                }
+        // Preserving model count:
+        //
+        // The only case where we add a model is if both assignments for the auxiiliary variable satisfy the formula
+        // for the same assignment of the original variables. This only happens if all(matched_lits) *AND*
+        // all(matches_clauses) are satisfied.
+        //
+        // The easiest way to fix this is to add one clause that constrains all(matched_lits) => -f
+        if (config.preserve_model_cnt) {
+            int new_clause = num_clauses + matched_lit_count + matched_clause_count;
+            auto cls = Clause();
+            cls.lits.push_back(-new_var);
+            for (int i = 0; i < matched_lit_count; ++i) {
+                int lit = m.lits[i];
+                cls.lits.push_back(-lit);
+                lit_to_clauses[lit_index(-lit)].push_back(new_clause);
             }
 
-            if (matched_lits.size() == 1) {
-                continue;
+            lit_to_clauses[(lit_index(-new_var))].push_back(new_clause);
+            lits_stored += cls.lits.size();
+            occs_stored += cls.lits.size();
+            (clauses)[new_clause] = std::move(cls);
+
+            if (config.generate_proof) {
+                const auto& lits = clauses[new_clause].lits;
+                proof.add(lits.data(), lits.size());
             }
+        }
+
 
-            if (matched_lits.size() <= config.matched_lits_cutoff &&
-                    matched_clauses->size() <= config.matched_cls_cutoff) {
+        set<int> valid_clause_ids;
+        for (int i = 0; i < matched_clause_count; ++i) {
+            config.steps--;
+            valid_clause_ids.insert(m.clauses_id[i]);
+        }
+
+        // Remove the old clauses.
+        int removed_clause_count = 0;
+        lits_to_update.clear();
+
+        for (auto to_remove : m.to_remove) {
+            int clause_idx = get<0>(to_remove);
+            int clause_id = get<1>(to_remove);
+
+            if (valid_clause_ids.find(clause_id) == valid_clause_ids.end()) {
                 continue;
             }
 
-            int matched_clause_count = matched_clauses->size();
-            int matched_lit_count = matched_lits.size();
+            auto cls = &(clauses)[clause_idx];
+            cls->deleted = true;
+            removed_clause_count += 1;
+            for (auto lit : cls->lits) {
+                config.steps--;
+                lit_count_adjust[lit_index(lit)] -= 1;
+                lits_to_update.insert(lit);
+            }
+
+            if (config.generate_proof) {
+                proof.del(cls->lits.data(), cls->lits.size());
+            }
+        }
+
+        adj_deleted += removed_clause_count;
+        num_clauses += matched_lit_count + matched_clause_count + (config.preserve_model_cnt ? 1 : 0);
+
+        // Update priorities.
+        for (auto lit : lits_to_update) {
+            // Q.push(lit);
+            pq.push(make_pair(
+                real_lit_count(lit),
+                lit
+            ));
+
+            // Reset adjacency matrix
+            auto& row = adjacency_matrix[sparsevec_lit_idx(lit)];
+            adj_nonzeros -= row.nonZeros();
+            row = Eigen::SparseVector<int>(adjacency_matrix_width);
+        }
+
+        // Q.push(new_var);
+        pq.push(make_pair(
+            lit_to_clauses[lit_index(new_var)].size() + (lit_count_adjust)[lit_index(new_var)],
+            new_var
+        ));
+
+        // Q.push(-new_var);
+        pq.push(make_pair(
+            lit_to_clauses[lit_index(-new_var)].size() + (lit_count_adjust)[lit_index(-new_var)],
+            -new_var
+        ));
+
+        // Q.push(var);
+        pq.push(make_pair(
+            lit_to_clauses[lit_index(var)].size() + (lit_count_adjust)[lit_index(var)],
+            var
+        ));
+
+        if (progress && replacements % progress_every == 0) progress(get_stats());
+    }
+
+    // The checks made before each step: the step budget, the time and memory
+    // limits and the replacement limit. Sets stop_reason when one is hit.
+    bool limit_reached(size_t num_replacements, SBVA::Tiebreak& tiebreak_mode) {
+        if ((cancel != nullptr && cancel->load(std::memory_order_relaxed))
+                || (portfolio_decided != nullptr && portfolio_decided->load(std::memory_order_relaxed))) {
+            if (config.verbosity)
+                cout << "c stopping SBVA, cancelled" << endl;
+            stop_reason = SBVA::Cancelled;
+            return true;
+        }
 
+        // check timeout
+        if (config.steps < 0 ) {
+            if (config.verbosity)
+                cout << "c stopping SBVA due to timeout. time remainK: "
+                    << std::setprecision(2) << std::fixed << config.steps/1000.0 << endl;
+            stop_reason = SBVA::StepLimit;
+            return true;
+        }
+        if (config.verbosity >= 2)
+            cout << "c time remainK: "
+                << std::setprecision(2) << std::fixed << config.steps/1000.0 << endl;
+
+        // check wall-clock and CPU-time limits
+        if (time_limit_hit()) {
+            if (config.verbosity)
+                cout << "c stopping SBVA due to "
+                    << (stop_reason == SBVA::TimeLimit ? "wall-clock" : "CPU-time")
+                    << " limit" << endl;
+            return true;
+        }
+
+        // check memory budget
+        if (mem_limit_hit(tiebreak_mode)) {
+            if (config.verbosity)
+                cout << "c stopping SBVA due to memory limit" << endl;
+            return true;
+        }
+
+        // check replacement limit
+        if (config.max_replacements != 0 && num_replacements == config.max_replacements) {
             if (config.verbosity) {
-                cout << "  mlits: ";
-                for (int matched_lit : matched_lits) {
-                    cout << matched_lit << " ";
-                }
-                cout << endl;
-                cout << "  mclauses:\n";
-                for (int matched_clause : (*matched_clauses)) {
-                    clauses[matched_clause].print("   -> ");
-                }
-                cout << endl;
+                cout << "Hit replacement limit (" << config.max_replacements << ")" << endl;
+            }
+            stop_reason = SBVA::ReplaceLimit;
+            return true;
+        }
+        return false;
+    }
 
-                cout << "--------------------" << endl;
+    // With seed given, only the variables marked in it start in the queue,
+    // others join as replacements touch them. Without one, a run that
+    // stopped before its queue ran empty is continued, under the tie-break
+    // it started with. Stops with SliceLimit once config.steps is down to
+    // slice_end, see run_for().
+    void run_sbva(SBVA::Tiebreak _tiebreak_mode, const vector<char>* seed = nullptr) {
+        if (seed || !engine.active) {
+            engine = Engine();
+            engine.active = true;
+            engine.tiebreak_mode = _tiebreak_mode;
+
+            // Add all of the variables from the original formula to the priority queue.
+            for (size_t i = 1; i <= num_vars; i++) {
+                if (seed && !(*seed)[i]) continue;
+                engine.pq.push(make_pair(real_lit_count(i), i));
+                engine.pq.push(make_pair(real_lit_count(-i), -i));
             }
-            assert(lit_to_clauses.size() == num_vars*2);
-            assert(lit_count_adjust.size() == num_vars*2);
 
-            // Do the substitution
-            num_vars += 1;
-            int new_var = num_vars;
+            Match& m = engine.m;
+            m.lits.reserve(10000);
+            m.clauses.reserve(10000);
+            m.clauses_swap.reserve(10000);
+            m.clauses_id.reserve(10000);
+            m.clauses_id_swap.reserve(10000);
+            m.ties.reserve(16);
+        }
 
-            // Prepare to add new clauses.
-            uint32_t new_sz = num_clauses + matched_lit_count + matched_clause_count +
-                (config.preserve_model_cnt ? 1 : 0);
-            if (clauses.size() >= new_sz) clauses.resize(new_sz);
-            else clauses.insert(clauses.end(), new_sz - clauses.size(), Clause());
+        LitQueue& pq = engine.pq;
+        Match& m = engine.m;
+        unordered_set<int>& lits_to_update = engine.lits_to_update;
+        size_t& num_replacements = engine.num_replacements;
+        SpeculationState& spec = engine.spec;
+        SBVA::Tiebreak& tiebreak_mode = engine.tiebreak_mode;
 
-            lit_to_clauses.insert(lit_to_clauses.end(), 2, vector<int>());
-            lit_count_adjust.insert(lit_count_adjust.end(), 2, 0);
-            if (sparsevec_lit_idx(new_var) >= adjacency_matrix_width) {
-                // The vectors must be constructed with a fixed, pre-determined width.
-                //
-                // This is quite an annoying limitation, as it means we have to re-construct
-                // all the vectors if we go above the width limit
-                adjacency_matrix_width = num_vars * 2;
-                adjacency_matrix.clear();
+        stop_reason = SBVA::Completed;
+        while (!pq.empty()) {
+            if (limit_reached(num_replacements, tiebreak_mode)) {
+                break;
+            }
+            if (config.steps <= slice_end) {
+                stop_reason = SBVA::SliceLimit;
+                break;
             }
-            adjacency_matrix.resize(num_vars);
 
-            // Add (f, lit) clauses.
-            for (int i = 0; i < matched_lit_count; ++i) {
-                config.steps--;
-                int lit = matched_lits[(i)];
-                int new_clause = num_clauses + i;
-
-                auto cls = Clause();
-                cls.lits.push_back(lit);
-                cls.lits.push_back(new_var); // new_var is always largest value
-                (clauses)[new_clause] = cls;
-
-                lit_to_clauses[lit_index(lit)].push_back(new_clause);
-                lit_to_clauses[lit_index(new_var)].push_back(new_clause);
-
-                if (config.generate_proof) {
-                    auto proof_lits = vector<int>();
-                    proof_lits.push_back(new_var); // new_var needs to be first for proof
-                    proof_lits.push_back(lit);
-                    proof.push_back(ProofClause(true, proof_lits));
-                }
+            if (config.speculate > 1) {
+                run_batch(pq, m, lits_to_update, num_replacements, tiebreak_mode, spec);
+                continue;
             }
 
-            // Add (-f, ...) clauses.
-            for (int i = 0; i < matched_clause_count; ++i) {
-                config.steps--;
-                int clause_idx = (*matched_clauses)[i];
-                auto new_clause = num_clauses + matched_lit_count + i;
-
-                auto cls = Clause();
-                cls.lits.push_back(-new_var); // -new_var is always smallest value
-                lit_to_clauses[lit_index(-new_var)].push_back(new_clause);
-
-                auto match_cls = clauses[(clause_idx)];
-                for (auto mlit : match_cls.lits) {
-                    if (mlit != var) {
-                        cls.lits.push_back(mlit);
-                        lit_to_clauses[lit_index(mlit)].push_back(new_clause);
-                    }
-                }
-                clauses[new_clause] = cls;
+            tmp_heuristic_cache_full.clear();
 
-                if (config.generate_proof) {
-                    proof.push_back(ProofClause(true, cls.lits));
-                }
+            // Get the next literal to evaluate.
+            pair<int, int> p = pq.top();
+            pq.pop();
+
+            int var = p.second;
+            int num_matched = p.first;
+
+            if (num_matched == 0 || num_matched != real_lit_count(var)) {
+                continue;
             }
 
-            // Preserving model count:
-            //
-            // The only case where we add a model is if both assignments for the auxiiliary variable satisfy the formula
-            // for the same assignment of the original variables. This only happens if all(matched_lits) *AND*
-            // all(matches_clauses) are satisfied.
-            //
-            // The easiest way to fix this is to add one clause that constrains all(matched_lits) => -f
-            if (config.preserve_model_cnt) {
-                int new_clause = num_clauses + matched_lit_count + matched_clause_count;
-                auto cls = Clause();
-                cls.lits.push_back(-new_var);
-                for (int i = 0; i < matched_lit_count; ++i) {
-                    int lit = (matched_lits)[i];
-                    cls.lits.push_back(-lit);
-                    lit_to_clauses[lit_index(-lit)].push_back(new_clause);
-                }
+            if (config.verbosity) {
+                cout << "Trying " << var << " (" << num_matched << ")" << endl;
+            }
 
-                (clauses)[new_clause] = cls;
-                lit_to_clauses[(lit_index(-new_var))].push_back(new_clause);
+            find_match(var, m, config.steps, tiebreak_mode,
+                [&](int lit, const vector<int>& ties, vector<int>& scores) {
+                    score_ties(lit, ties, scores);
+                },
+                config.verbosity, config.num_threads);
+            if (!worth_replacing(m)) {
+                continue;
+            }
+
+            apply_match(m, pq, lits_to_update);
+            num_replacements += 1;
+        }
+        if (config.verbosity && spec.batches > 0) {
+            cout << "c speculation: " << spec.evaluated << " entries in " << spec.batches
+                << " batches, " << spec.reevaluated << " evaluated again, "
+                << spec.match_time << " s matching, " << spec.commit_time << " s committing" << endl;
+        }
+        engine.active = !pq.empty();
+        proof.flush();
+    }
+
+    // The speculative mode of run_sbva(). Pops up to config.speculate live
+    // queue entries, matches them on num_threads threads against the formula
+    // as it stands, then commits them one by one in queue order. An entry
+    // whose match read a variable that an earlier commit of the batch touched
+    // is matched again first. Each match depends on the formula alone, so
+    // for a given batch size the result does not depend on the number of
+    // threads or their timing.
+    void run_batch(LitQueue& pq, Match& m, unordered_set<int>& lits_to_update,
+            size_t& num_replacements, SBVA::Tiebreak tiebreak_mode, SpeculationState& spec) {
+        vector<Speculation>& batch = spec.batch;
+        size_t n = 0;
+        while (n < config.speculate && !pq.empty()) {
+            pair<int, int> p = pq.top();
+            pq.pop();
+            if (p.first == 0 || p.first != real_lit_count(p.second)) continue;
+            if (batch.size() <= n) batch.emplace_back();
+            batch[n++].entry = p;
+        }
+        if (n == 0) return;
+
+        const auto match_start = chrono::steady_clock::now();
+        std::atomic<size_t> next(0);
+        parallel_run(std::min<size_t>(config.num_threads, n), [&](uint32_t) {
+            for (size_t i; (i = next++) < n;) speculate(batch[i], tiebreak_mode);
+        });
+        const auto commit_start = chrono::steady_clock::now();
+        spec.match_time += chrono::duration<double>(commit_start - match_start).count();
+        spec.batches++;
+        spec.evaluated += n;
+
+        spec.epoch++;
+        spec.changed.resize(num_vars + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            Speculation& s = batch[i];
+            config.steps += s.steps; // the steps s.steps went down by
+            if (config.steps < 0
+                    || (config.max_replacements != 0 && num_replacements == config.max_replacements)) {
+                // keep the queue whole, the entries left are not stale
+                for (size_t j = i; j < n; j++) pq.push(batch[j].entry);
+                break;
+            }
 
-                if (config.generate_proof) {
-                    proof.push_back(ProofClause(true, cls.lits));
+            const Match* match = &s.m;
+            bool dirty = false;
+            for (int v : s.read_vars) {
+                if (spec.changed[v] == spec.epoch) {
+                    dirty = true;
+                    break;
                 }
             }
+            if (dirty) {
+                const int var = s.entry.second;
+                // a newer entry for var is queued already
+                if (s.entry.first != real_lit_count(var)) continue;
+                spec.reevaluated++;
+                tmp_heuristic_cache_full.clear();
+                find_match(var, m, config.steps, tiebreak_mode,
+                    [&](int lit, const vector<int>& ties, vector<int>& scores) {
+                        score_ties(lit, ties, scores);
+                    },
+                    0, config.num_threads);
+                match = &m;
+            }
+            if (!worth_replacing(*match)) continue;
 
+            apply_match(*match, pq, lits_to_update);
+            num_replacements += 1;
+            spec.changed.resize(num_vars + 1, 0);
+            for (int lit : lits_to_update) spec.changed[abs(lit)] = spec.epoch;
+        }
 
-            set<int> valid_clause_ids;
-            for (int i = 0; i < matched_clause_count; ++i) {
-                config.steps--;
-                valid_clause_ids.insert((*matched_clauses_id)[i]);
+        // keep the adjacency rows built on the way that are still exact
+        for (size_t i = 0; i < n; i++) {
+            for (auto& row : batch[i].rows) {
+                if (spec.changed[row.first] == spec.epoch) continue;
+                auto& cached = adjacency_matrix[sparsevec_lit_idx(row.first)];
+                if (cached.nonZeros() > 0 || row.second.size() != (Eigen::Index)adjacency_matrix_width) continue;
+                adj_nonzeros += row.second.nonZeros();
+                cached.swap(row.second);
             }
+        }
+        spec.commit_time += chrono::duration<double>(chrono::steady_clock::now() - commit_start).count();
+    }
+
+    // Round-based SBVA. Each round takes the config.rounds largest live
+    // entries off the queue, matches them on num_threads threads against the
+    // formula as it stands, then applies the matches with the largest
+    // reduction first, as long as none of their clauses was removed and none
+    // of their literals was matched by an earlier replacement of the round.
+    // A replacement stays sound as long as the clauses it removes are all
+    // there, though serial SBVA may have grown a different match by then.
+    // Matches put off go back on the queue. The result does not depend on
+    // the number of threads.
+    void run_rounds(SBVA::Tiebreak tiebreak_mode) {
+        LitQueue pq;
+        for (size_t i = 1; i <= num_vars; i++) {
+            pq.push(make_pair(real_lit_count(i), i));
+            pq.push(make_pair(real_lit_count(-i), -i));
+        }
 
-            // Remove the old clauses.
-            int removed_clause_count = 0;
-            lits_to_update.clear();
+        const uint32_t num_threads = config.num_threads;
+        vector<int> queued;
+        vector<uint32_t> queued_in;  // per literal, the last round it was taken in
+        vector<uint32_t> matched_in; // per literal, the last round it was matched in
+        vector< vector<Speculation> > found(num_threads);
+        vector<int64_t> steps(num_threads);
+        vector<Speculation> candidates;
+        vector<int> dropped_rows;
+        unordered_set<int> lits_to_update;
+        size_t num_replacements = 0;
+        size_t rounds = 0;
+        size_t evaluated = 0;
+        size_t deferred = 0;
+        double match_time = 0;
+        double apply_time = 0;
 
-            for (auto to_remove : clauses_to_remove) {
-                int clause_idx = get<0>(to_remove);
-                int clause_id = get<1>(to_remove);
+        stop_reason = SBVA::Completed;
+        while (!pq.empty()) {
+            if (limit_reached(num_replacements, tiebreak_mode)) break;
+            const uint32_t round = ++rounds;
+
+            queued.clear();
+            queued_in.resize(num_vars * 2, 0);
+            while (queued.size() < config.rounds && !pq.empty()) {
+                pair<int, int> p = pq.top();
+                pq.pop();
+                if (p.first == 0 || p.first != real_lit_count(p.second)) continue;
+                if (queued_in[lit_index(p.second)] == round) continue;
+                queued_in[lit_index(p.second)] = round;
+                queued.push_back(p.second);
+            }
 
-                if (valid_clause_ids.find(clause_id) == valid_clause_ids.end()) {
+            // rebuild the rows the last round dropped, so that the matches
+            // share them
+            if (tiebreak_mode == SBVA::Tiebreak::ThreeHop && mem_stage == 0) {
+                std::sort(dropped_rows.begin(), dropped_rows.end());
+                dropped_rows.erase(std::unique(dropped_rows.begin(), dropped_rows.end()), dropped_rows.end());
+                build_adjacency_matrix(&dropped_rows);
+            }
+            dropped_rows.clear();
+
+            const auto match_start = chrono::steady_clock::now();
+            std::atomic<size_t> next(0);
+            parallel_run(std::min<size_t>(num_threads, queued.size()), [&](uint32_t t) {
+                Speculation s;
+                steps[t] = 0;
+                for (size_t i; (i = next++) < queued.size();) {
+                    const int lit = queued[i];
+                    s.entry = make_pair(real_lit_count(lit), lit);
+                    speculate(s, tiebreak_mode);
+                    steps[t] += s.steps;
+                    if (!worth_replacing(s.m)) continue;
+                    // keep the match but not the scratch space
+                    found[t].emplace_back();
+                    Speculation& kept = found[t].back();
+                    kept.entry = s.entry;
+                    kept.m.var = s.m.var;
+                    kept.m.lits = s.m.lits;
+                    kept.m.clauses = s.m.clauses;
+                    kept.m.clauses_id = s.m.clauses_id;
+                    kept.m.to_remove = s.m.to_remove;
+                }
+            });
+            candidates.clear();
+            for (uint32_t t = 0; t < num_threads; t++) {
+                config.steps += steps[t];
+                steps[t] = 0;
+                for (Speculation& s : found[t]) candidates.push_back(std::move(s));
+                found[t].clear();
+            }
+            std::sort(candidates.begin(), candidates.end(), [](const Speculation& a, const Speculation& b) {
+                const int ra = reduction(a.m.lits.size(), a.m.clauses.size());
+                const int rb = reduction(b.m.lits.size(), b.m.clauses.size());
+                if (ra != rb) return ra > rb;
+                return lit_index(a.entry.second) < lit_index(b.entry.second);
+            });
+            const auto apply_start = chrono::steady_clock::now();
+            match_time += chrono::duration<double>(apply_start - match_start).count();
+            evaluated += queued.size();
+
+            size_t applied = 0;
+            bool stopped = false;
+            for (Speculation& s : candidates) {
+                if (stopped || limit_reached(num_replacements, tiebreak_mode)) {
+                    stopped = true;
+                    break;
+                }
+                if (overlaps(s.m, matched_in, round)) {
+                    pq.push(make_pair(real_lit_count(s.m.var), s.m.var));
+                    deferred++;
                     continue;
                 }
 
-                auto cls = &(clauses)[clause_idx];
-                cls->deleted = true;
-                removed_clause_count += 1;
-                for (auto lit : cls->lits) {
-                    config.steps--;
-                    lit_count_adjust[lit_index(lit)] -= 1;
-                    lits_to_update.insert(lit);
+                apply_match(s.m, pq, lits_to_update);
+                num_replacements += 1;
+                applied++;
+                matched_in.resize(num_vars * 2, 0);
+                for (int lit : s.m.lits) matched_in[lit_index(lit)] = round;
+                for (int lit : lits_to_update) dropped_rows.push_back(std::abs(lit));
+                dropped_rows.push_back(num_vars);
+            }
+            apply_time += chrono::duration<double>(chrono::steady_clock::now() - apply_start).count();
+            if (config.verbosity >= 2) {
+                cout << "c round " << round << ": " << queued.size() << " literals matched, "
+                    << candidates.size() << " worth replacing, " << applied << " replaced" << endl;
+            }
+            if (stopped) break;
+        }
+        if (config.verbosity) {
+            cout << "c rounds: " << rounds << ", " << evaluated << " literals matched, "
+                << num_replacements << " replaced, " << deferred << " put off, "
+                << match_time << " s matching, " << apply_time << " s applying" << endl;
+        }
+        proof.flush();
+    }
+
+    // True if a clause m would remove is gone, or one of its literals was
+    // matched in this round already.
+    bool overlaps(const Match& m, const vector<uint32_t>& matched_in, uint32_t round) const {
+        for (int lit : m.lits) {
+            if (lit_index(lit) < matched_in.size() && matched_in[lit_index(lit)] == round) return true;
+        }
+        vector<int> ids(m.clauses_id);
+        std::sort(ids.begin(), ids.end());
+        for (const auto& to_remove : m.to_remove) {
+            if (!std::binary_search(ids.begin(), ids.end(), get<1>(to_remove))) continue;
+            if (clauses[get<0>(to_remove)].deleted) return true;
+        }
+        return false;
+    }
+
+    // Matches one entry of a batch. Runs concurrently with the others, so
+    // the shared adjacency cache is only read and missing rows are built
+    // into s.rows.
+    void speculate(Speculation& s, SBVA::Tiebreak tiebreak_mode) const {
+        const int var = s.entry.second;
+        s.steps = 0;
+        s.read_vars.clear();
+        s.heuristic_cache.clear();
+        s.rows.clear();
+        find_match(var, s.m, s.steps, tiebreak_mode,
+            [&](int lit, const vector<int>& ties, vector<int>& scores) {
+                scores.resize(ties.size());
+                for (size_t i = 0; i < ties.size(); i++) {
+                    scores[i] = speculative_heuristic(lit, ties[i], s);
                 }
+            },
+            0);
+
+        // Mcls is always a subset of F[var], and every clause looked at is
+        // found through one of their literals
+        s.read_vars.push_back(std::abs(var));
+        for (int cid : lit_to_clauses[lit_index(var)]) {
+            if (clauses[cid].deleted) continue;
+            for (int lit : clauses[cid].lits) s.read_vars.push_back(std::abs(lit));
+        }
+    }
+
+    const Eigen::SparseVector<int>& speculative_row(int lit, Speculation& s) const {
+        const int abslit = std::abs(lit);
+        s.read_vars.push_back(abslit);
+        const auto& cached = adjacency_matrix[sparsevec_lit_idx(abslit)];
+        if (cached.nonZeros() > 0) return cached;
+        auto& row = s.rows[abslit];
+        if (row.nonZeros() == 0) row = adjacency_row(abslit, s.steps);
+        return row;
+    }
+
+    // tiebreaking_heuristic() for speculate()
+    int speculative_heuristic(int lit1, int lit2, Speculation& s) const {
+        auto it = s.heuristic_cache.find(sparsevec_lit_idx(lit2));
+        if (it != s.heuristic_cache.end()) {
+            return it->second;
+        }
+        const auto& vec1 = speculative_row(lit1, s);
+        const auto& vec2 = speculative_row(lit2, s);
+
+        int total_count = 0;
+        for (Eigen::SparseVector<int>::InnerIterator it2(vec2); it2; ++it2) {
+            s.steps--;
+            int var = sparcevec_lit_for_idx(it2.index());
+            const auto& vec3 = speculative_row(var, s);
+            total_count += it2.value() * vec3.dot(vec1);
+        }
+        s.heuristic_cache[sparsevec_lit_idx(lit2)] = total_count;
+        return total_count;
+    }
+
+    // The whole run, or with slice_steps >= 0 only until about that many
+    // more steps are used, see CNF::run_for()
+    void run(SBVA::Tiebreak tiebreak_mode, int64_t slice_steps = -1) {
+        const bool classic = !config.split_components && config.partitions <= 1 && config.rounds == 0;
+        slice_end = std::numeric_limits<int64_t>::min();
+        if (classic && slice_steps >= 0 && config.steps >= 0) slice_end = config.steps - slice_steps;
+        run_start = chrono::steady_clock::now();
+        running = true;
+        if (config.split_components) run_components(tiebreak_mode);
+        else if (config.partitions > 1) run_partitioned(tiebreak_mode);
+        else if (config.rounds > 0) run_rounds(tiebreak_mode);
+        else run_sbva(tiebreak_mode);
+        running = false;
+        run_time += chrono::duration<double>(chrono::steady_clock::now() - run_start).count();
+    }
+
+    // run() with a cancel flag and progress reports, see CNF::run_async()
+    SBVA::Stats run_watched(SBVA::Tiebreak tiebreak_mode, const std::atomic<bool>* _cancel,
+            const std::function<void(const SBVA::Stats&)>& _progress, uint64_t _progress_every) {
+        cancel = _cancel;
+        if (_progress_every != 0) {
+            progress = _progress;
+            progress_every = _progress_every;
+        }
+        run(tiebreak_mode);
+        cancel = nullptr;
+        progress = nullptr;
+        const SBVA::Stats st = get_stats();
+        if (_progress) _progress(st);
+        return st;
+    }
+
+    // A set of clauses SBVA can run on by itself, over renumbered variables.
+    struct Part {
+        vector<uint32_t> vars;   // local variable v is vars[v-1], ascending
+        vector<size_t> clauses;  // clause indices in this formula
+        size_t num_lits = 0;
+    };
+
+    // Runs SBVA separately on each connected component of the variable graph,
+    // several components at a time on num_threads threads. Replacements never
+    // cross components, so each one gets its own Formula over renumbered
+    // variables. The replacement limit is global, so with one set the whole
+    // formula is run as usual.
+    void run_components(SBVA::Tiebreak tiebreak_mode) {
+        if (config.max_replacements != 0) {
+            if (config.verbosity)
+                cout << "c replacement limit set, not splitting into components" << endl;
+            run_sbva(tiebreak_mode);
+            return;
+        }
+
+        // union-find over the variables, the smaller variable becomes the root
+        vector<uint32_t> root(num_vars + 1);
+        for (size_t v = 0; v <= num_vars; v++) root[v] = v;
+        auto find = [&](uint32_t v) {
+            while (root[v] != v) {
+                root[v] = root[root[v]];
+                v = root[v];
+            }
+            return v;
+        };
+        for (size_t i = 0; i < num_clauses; i++) {
+            const Clause& cl = std::as_const(clauses)[i];
+            if (cl.deleted || cl.lits.empty()) continue;
+            uint32_t a = find(abs(cl.lits[0]));
+            for (size_t k = 1; k < cl.lits.size(); k++) {
+                uint32_t b = find(abs(cl.lits[k]));
+                if (a == b) continue;
+                if (a > b) std::swap(a, b);
+                root[b] = a;
+            }
+        }
+
+        vector<Part> comps;
+        vector<uint32_t> comp_of(num_vars + 1, UINT32_MAX);
+        vector<uint32_t> local_var(num_vars + 1, 0);
+        for (size_t v = 1; v <= num_vars; v++) {
+            const uint32_t r = find(v);
+            if (comp_of[r] == UINT32_MAX) {
+                comp_of[r] = comps.size();
+                comps.emplace_back();
+            }
+            comp_of[v] = comp_of[r];
+            comps[comp_of[v]].vars.push_back(v);
+            local_var[v] = comps[comp_of[v]].vars.size();
+        }
+        for (size_t i = 0; i < num_clauses; i++) {
+            const Clause& cl = std::as_const(clauses)[i];
+            if (cl.deleted || cl.lits.empty()) continue;
+            Part& c = comps[comp_of[abs(cl.lits[0])]];
+            c.clauses.push_back(i);
+            c.num_lits += cl.lits.size();
+        }
+        comps.erase(std::remove_if(comps.begin(), comps.end(),
+            [](const Part& c) { return c.clauses.empty(); }), comps.end());
+
+        if (comps.size() <= 1) {
+            run_sbva(tiebreak_mode);
+            return;
+        }
+        if (config.verbosity) {
+            const Part& largest = *std::max_element(comps.begin(), comps.end(),
+                [](const Part& a, const Part& b) { return a.num_lits < b.num_lits; });
+            cout << "c running SBVA on " << comps.size() << " components, largest has "
+                << largest.vars.size() << " vars and "
+                << largest.clauses.size() << " clauses" << endl;
+        }
+        run_parts(comps, local_var, tiebreak_mode);
+    }
+
+    // Splits the variables into config.partitions parts of about the same
+    // number of occurrences with few clauses between them, by label
+    // propagation: starting from runs of consecutive variables, each variable
+    // repeatedly moves to the part most of its clause neighbours are in, as
+    // long as that part has room. The clauses inside each part are reduced
+    // in parallel by run_parts(). A replacement only needs its matched
+    // clauses, so this is sound whatever the other clauses are. What is left
+    // at the part boundaries is picked up by a serial run that starts from
+    // the variables of the cut clauses.
+    void run_partitioned(SBVA::Tiebreak tiebreak_mode) {
+        if (config.max_replacements != 0) {
+            if (config.verbosity)
+                cout << "c replacement limit set, not partitioning" << endl;
+            run_sbva(tiebreak_mode);
+            return;
+        }
 
-                if (config.generate_proof) {
-                    proof.push_back(ProofClause(false, cls->lits));
+        const uint32_t k = config.partitions;
+        vector<uint64_t> weight(num_vars + 1, 0);
+        uint64_t total = 0;
+        for (size_t i = 0; i < num_clauses; i++) {
+            const Clause& cl = std::as_const(clauses)[i];
+            if (cl.deleted) continue;
+            for (int lit : cl.lits) weight[abs(lit)]++;
+            total += cl.lits.size();
+        }
+        uint64_t max_weight = 0;
+        for (size_t v = 1; v <= num_vars; v++) max_weight = std::max(max_weight, weight[v]);
+        const uint64_t cap = total / k + total / k / 20 + max_weight;
+
+        vector<uint32_t> label(num_vars + 1, 0);
+        vector<uint64_t> part_weight(k, 0);
+        uint64_t seen = 0;
+        for (size_t v = 1; v <= num_vars; v++) {
+            label[v] = std::min<uint64_t>(k - 1, seen * k / std::max<uint64_t>(total, 1));
+            part_weight[label[v]] += weight[v];
+            seen += weight[v];
+        }
+
+        vector<uint64_t> links(k, 0);
+        vector<uint32_t> touched;
+        size_t rounds = 0;
+        for (size_t moved = 1; moved != 0 && rounds < 10; rounds++) {
+            moved = 0;
+            for (size_t v = 1; v <= num_vars; v++) {
+                if (weight[v] == 0) continue;
+                touched.clear();
+                for (int lit : {(int)v, -(int)v}) {
+                    for (int c : std::as_const(lit_to_clauses)[lit_index(lit)]) {
+                        const Clause& cl = std::as_const(clauses)[c];
+                        if (cl.deleted) continue;
+                        for (int other : cl.lits) {
+                            if (abs(other) == (int)v) continue;
+                            const uint32_t l = label[abs(other)];
+                            if (links[l]++ == 0) touched.push_back(l);
+                        }
+                    }
+                }
+                const uint32_t cur = label[v];
+                uint32_t best = cur;
+                for (uint32_t l : touched) {
+                    if (l == best || part_weight[l] + weight[v] > cap) continue;
+                    if (links[l] > links[best]) best = l;
                 }
+                for (uint32_t l : touched) links[l] = 0;
+                if (best == cur) continue;
+                part_weight[cur] -= weight[v];
+                part_weight[best] += weight[v];
+                label[v] = best;
+                moved++;
             }
+        }
 
-            adj_deleted += removed_clause_count;
-            num_clauses += matched_lit_count + matched_clause_count + (config.preserve_model_cnt ? 1 : 0);
+        vector<Part> parts(k);
+        vector<uint32_t> local_var(num_vars + 1, 0);
+        for (size_t v = 1; v <= num_vars; v++) {
+            parts[label[v]].vars.push_back(v);
+            local_var[v] = parts[label[v]].vars.size();
+        }
+        vector<char> boundary(num_vars + 1, 0);
+        size_t cut = 0;
+        for (size_t i = 0; i < num_clauses; i++) {
+            const Clause& cl = std::as_const(clauses)[i];
+            if (cl.deleted || cl.lits.empty()) continue;
+            const uint32_t l = label[abs(cl.lits[0])];
+            bool inside = true;
+            for (int lit : cl.lits) inside &= label[abs(lit)] == l;
+            if (inside) {
+                parts[l].clauses.push_back(i);
+                parts[l].num_lits += cl.lits.size();
+            } else {
+                for (int lit : cl.lits) boundary[abs(lit)] = 1;
+                cut++;
+            }
+        }
+        if (config.verbosity) {
+            size_t num_boundary = 0;
+            for (size_t v = 1; v <= num_vars; v++) num_boundary += boundary[v];
+            cout << "c partitioned into " << k << " parts in " << rounds << " rounds, "
+                << cut << " cut clauses, " << num_boundary << " boundary vars" << endl;
+        }
 
-            // Update priorities.
-            for (auto lit : lits_to_update) {
-                // Q.push(lit);
-                pq.push(make_pair(
-                    real_lit_count(lit),
-                    lit
-                ));
+        parts.erase(std::remove_if(parts.begin(), parts.end(),
+            [](const Part& c) { return c.clauses.empty(); }), parts.end());
+        if (parts.size() <= 1) {
+            run_sbva(tiebreak_mode);
+            return;
+        }
+        // the propagation's scratch is not counted by the memory budget of
+        // the parts, so it goes first, and the part lists before the
+        // boundary sweep
+        vector<uint64_t>().swap(weight);
+        vector<uint32_t>().swap(label);
+        run_parts(parts, local_var, tiebreak_mode);
+        vector<Part>().swap(parts);
+        vector<uint32_t>().swap(local_var);
+        if (stop_reason != SBVA::Completed) return;
+
+        // new variables only touch the clauses of their own part, so the
+        // boundary sweep starts from the boundary variables alone
+        boundary.resize(num_vars + 1, 0);
+        run_sbva(tiebreak_mode, &boundary);
+    }
 
-                // Reset adjacency matrix
-                adjacency_matrix[sparsevec_lit_idx(lit)] = Eigen::SparseVector<int>(adjacency_matrix_width);
+    // Runs SBVA on each part by itself, several at a time on num_threads
+    // threads, then merges the results back in part order, which fixes the
+    // ids of the new variables and the order of the added clauses and proof
+    // lines whatever the thread timing. local_var maps the variables of each
+    // part to their local ids. The step budget is split by the parts' sizes.
+    void run_parts(vector<Part>& parts, const vector<uint32_t>& local_var, SBVA::Tiebreak tiebreak_mode) {
+        size_t total_lits = 0;
+        for (const Part& part : parts) total_lits += part.num_lits;
+
+        // biggest parts first, so that no thread is left with a big one at
+        // the end
+        vector<size_t> order(parts.size());
+        for (size_t c = 0; c < parts.size(); c++) order[c] = c;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return parts[a].num_lits > parts[b].num_lits;
+        });
+
+        // The memory budget left over by this formula and the parts' lists
+        // is split by size as well. Parts still check the process RSS
+        // against the whole limit.
+        uint64_t mem_left = 0;
+        if (config.mem_limit != 0) {
+            uint64_t used = mem_footprint();
+            for (const Part& part : parts) {
+                used += part.vars.capacity() * sizeof(uint32_t) + part.clauses.capacity() * sizeof(size_t);
             }
+            if (used < config.mem_limit) mem_left = config.mem_limit - used;
+        }
 
-            // Q.push(new_var);
-            pq.push(make_pair(
-                lit_to_clauses[lit_index(new_var)].size() + (lit_count_adjust)[lit_index(new_var)],
-                new_var
-            ));
+        vector<SBVA::Config> sub_configs(parts.size(), config);
+        vector<unique_ptr<Formula>> subs(parts.size());
+        int64_t steps_given = 0;
+        for (size_t c = 0; c < parts.size(); c++) {
+            SBVA::Config& sc = sub_configs[c];
+            sc.steps = (int64_t)((long double)config.steps * parts[c].num_lits / total_lits);
+            steps_given += sc.steps;
+            if (config.mem_limit != 0) {
+                sc.mem_limit = std::max<uint64_t>(1,
+                    (uint64_t)((long double)mem_left * parts[c].num_lits / total_lits));
+            }
+            sc.verbosity = 0;
+            sc.num_threads = 1;
+            sc.split_components = false;
+            sc.partitions = 0;
+            sc.speculate = 0;
+            sc.rounds = 0;
+        }
+        config.steps -= steps_given;
+        stop_reason = SBVA::Completed;
+
+        // Each finished part is merged, and freed, as soon as the parts
+        // before it are merged. Copying a part out of this formula and
+        // merging into it are done under merge_lock.
+        std::mutex merge_lock;
+        size_t next_merge = 0;
+        vector<int> global(1);
+        vector<int> mapped;
+        auto merge_ready = [&]() {
+            for (; next_merge < parts.size() && subs[next_merge]; next_merge++) {
+                merge_part(parts[next_merge], *subs[next_merge], global, mapped);
+                subs[next_merge].reset();
+            }
+        };
 
-            // Q.push(-new_var);
-            pq.push(make_pair(
-                lit_to_clauses[lit_index(-new_var)].size() + (lit_count_adjust)[lit_index(-new_var)],
-                -new_var
-            ));
+        // seconds each part took, to see how well the work divides up
+        vector<double> part_time(parts.size(), 0);
+        const auto parts_start = chrono::steady_clock::now();
+        std::atomic<size_t> next(0);
+        parallel_run(config.num_threads, [&](uint32_t) {
+            vector<int> lits;
+            for (size_t n; (n = next++) < order.size();) {
+                const size_t c = order[n];
+                const auto part_start = chrono::steady_clock::now();
+                const Part& part = parts[c];
+                Formula* sub = new Formula(sub_configs[c]);
+                sub->start_wall = start_wall;
+                sub->start_cpu = start_cpu;
+                sub->cancel = cancel;
+                sub->rss_limit = rss_limit;
+                sub->mem_from_rss = false;
+                sub->init_cnf(part.vars.size());
+                lits.clear();
+                {
+                    std::lock_guard<std::mutex> guard(merge_lock);
+                    for (size_t i : part.clauses) {
+                        for (int lit : std::as_const(clauses)[i].lits) {
+                            const int v = local_var[abs(lit)];
+                            lits.push_back(lit < 0 ? -v : v);
+                        }
+                        lits.push_back(0);
+                    }
+                }
+                sub->add_clauses(lits.data(), lits.size());
+                sub->finish_cnf();
+                sub->config.steps = sub_configs[c].steps;
+                sub->run_sbva(tiebreak_mode);
+                part_time[c] = chrono::duration<double>(chrono::steady_clock::now() - part_start).count();
+
+                std::lock_guard<std::mutex> guard(merge_lock);
+                subs[c].reset(sub);
+                merge_ready();
+            }
+        });
+        assert(next_merge == parts.size());
+        if (config.verbosity) {
+            const double took = chrono::duration<double>(chrono::steady_clock::now() - parts_start).count();
+            cout << "c reduced " << parts.size() << " parts in " << took << " s on "
+                << config.num_threads << " threads, the longest part took "
+                << *std::max_element(part_time.begin(), part_time.end()) << " s" << endl;
+        }
 
-            // Q.push(var);
-            pq.push(make_pair(
-                lit_to_clauses[lit_index(var)].size() + (lit_count_adjust)[lit_index(var)],
-                var
-            ));
+        // the cached rows are stale now and are rebuilt on demand
+        if (num_vars * 2 > adjacency_matrix_width) adjacency_matrix_width = num_vars * 2;
+        drop_adjacency_cache();
+        proof.flush();
+    }
 
-            num_replacements += 1;
+    // Takes the result of sub, run on part, into this formula: its new
+    // variables get the next ids, removed clauses are marked deleted and
+    // added ones appended, and its proof is replayed over the global ids.
+    // global and mapped are scratch space.
+    void merge_part(const Part& part, Formula& sub, vector<int>& global, vector<int>& mapped) {
+        config.steps += sub.config.steps;
+        replacements += sub.replacements;
+        if (stop_reason == SBVA::Completed) stop_reason = sub.stop_reason;
+
+        global.resize(sub.num_vars + 1);
+        for (size_t v = 1; v <= part.vars.size(); v++) global[v] = part.vars[v-1];
+        for (size_t v = part.vars.size() + 1; v <= sub.num_vars; v++) global[v] = ++num_vars;
+        lit_to_clauses.resize(num_vars * 2);
+        lit_count_adjust.resize(num_vars * 2);
+        auto map_lits = [&](const int* lits, size_t num) {
+            mapped.clear();
+            for (size_t k = 0; k < num; k++) {
+                mapped.push_back(lits[k] < 0 ? -global[-lits[k]] : global[lits[k]]);
+            }
+        };
+
+        for (size_t j = 0; j < sub.num_input_clauses; j++) {
+            if (!std::as_const(sub.clauses)[j].deleted) continue;
+            Clause& cl = clauses[part.clauses[j]];
+            cl.deleted = true;
+            adj_deleted++;
+            for (int lit : cl.lits) lit_count_adjust[lit_index(lit)] -= 1;
         }
-        delete matched_clauses;
-        delete matched_clauses_swap;
-        delete matched_clauses_id;
-        delete matched_clauses_id_swap;
+        for (size_t j = sub.num_input_clauses; j < sub.num_clauses; j++) {
+            const Clause& scl = std::as_const(sub.clauses)[j];
+            if (scl.deleted) continue;
+            map_lits(scl.lits.data(), scl.lits.size());
+            clauses.push_back(Clause());
+            clauses.back().lits = mapped;
+            for (int lit : mapped) lit_to_clauses[lit_index(lit)].push_back(num_clauses);
+            lits_stored += mapped.size();
+            occs_stored += mapped.size();
+            num_clauses++;
+        }
+        if (config.generate_proof) {
+            sub.proof.for_each_pending([&](bool is_del, const int* lits, size_t num) {
+                map_lits(lits, num);
+                if (is_del) proof.del(mapped.data(), mapped.size());
+                else proof.add(mapped.data(), mapped.size());
+            });
+        }
+    }
+
+    // See CNF::run_portfolio(). Each entry gets a copy of this formula. A
+    // finished entry is compared with the best one so far right away and
+    // the loser is freed, so at most num_threads + 1 copies exist at once.
+    // The kept copy's clauses and proof lines are then taken over.
+    size_t run_portfolio(const vector<SBVA::PortfolioEntry>& entries, bool first_done,
+            vector<SBVA::PortfolioResult>& results, const std::atomic<bool>* _cancel) {
+        const size_t n = entries.size();
+        if (n == 0) {
+            fprintf(stderr, "Error: run_portfolio needs at least one entry\n");
+            exit(1);
+        }
+        const auto portfolio_start = chrono::steady_clock::now();
+        results.assign(n, SBVA::PortfolioResult());
+        vector<SBVA::Config> configs(n);
+        for (size_t i = 0; i < n; i++) {
+            configs[i] = entries[i].config;
+            configs[i].verbosity = 0;
+            configs[i].generate_proof = config.generate_proof;
+        }
+
+        // The memory budget left over by this formula is split between the
+        // entries running at once. A copy starts out sharing this formula's
+        // chunks, so it may use its share on top of its footprint then, and
+        // checks the process RSS against the whole limit, like the parts of
+        // run_parts().
+        uint64_t mem_share = 0;
+        if (config.mem_limit != 0) {
+            const uint64_t used = mem_footprint();
+            const size_t at_once = std::max<size_t>(1, std::min<size_t>(config.num_threads, n));
+            if (used < config.mem_limit) mem_share = (config.mem_limit - used) / at_once;
+        }
+
+        std::atomic<size_t> next(0);
+        std::atomic<bool> decided(false);
+        std::mutex best_mutex;
+        std::unique_ptr<Formula> best;
+        size_t best_idx = n;
+        parallel_run(std::min<size_t>(config.num_threads, n), [&](uint32_t) {
+            for (size_t i; (i = next++) < n;) {
+                if (first_done && decided) break;
+                const auto start = chrono::steady_clock::now();
+                std::unique_ptr<Formula> f(new Formula(*this, configs[i]));
+                f->cancel = _cancel;
+                if (first_done) f->portfolio_decided = &decided;
+                if (config.mem_limit != 0) {
+                    const uint64_t cap = f->mem_footprint() + std::max<uint64_t>(1, mem_share);
+                    if (f->config.mem_limit == 0 || f->config.mem_limit > cap) f->config.mem_limit = cap;
+                    f->rss_limit = config.mem_limit;
+                    f->mem_from_rss = false;
+                }
+                f->run(entries[i].tiebreak);
+
+                SBVA::PortfolioResult& r = results[i];
+                r.started = true;
+                r.num_vars = f->num_vars;
+                r.num_clauses = f->num_clauses - f->adj_deleted;
+                r.steps_left = f->config.steps;
+                r.time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                r.stop = f->stop_reason;
+
+                std::lock_guard<std::mutex> lock(best_mutex);
+                if (first_done) {
+                    if (decided) continue;
+                    decided = true;
+                } else if (best && (results[best_idx].num_clauses < r.num_clauses
+                        || (results[best_idx].num_clauses == r.num_clauses && best_idx < i))) {
+                    continue;
+                }
+                best.swap(f);
+                best_idx = i;
+            }
+        });
+
+        // take over the kept copy
+        Formula& w = *best;
+        clauses.swap(w.clauses);
+        lit_to_clauses.swap(w.lit_to_clauses);
+        lit_count_adjust.swap(w.lit_count_adjust);
+        adjacency_matrix.swap(w.adjacency_matrix);
+        num_vars = w.num_vars;
+        num_clauses = w.num_clauses;
+        curr_clause = w.curr_clause;
+        adj_deleted = w.adj_deleted;
+        adjacency_matrix_width = w.adjacency_matrix_width;
+        lits_stored = w.lits_stored;
+        occs_stored = w.occs_stored;
+        adj_nonzeros = w.adj_nonzeros;
+        stop_reason = w.stop_reason;
+        tmp_heuristic_cache_full.clear();
+        // a run_for() slice before the portfolio queued the old formula
+        engine = Engine();
+        // steps used and left are the kept entry's, out of its own budget
+        steps_budget = w.steps_budget;
+        config.steps = w.config.steps;
+        replacements += w.replacements;
+        run_time += chrono::duration<double>(chrono::steady_clock::now() - portfolio_start).count();
+        if (config.generate_proof) {
+            w.proof.for_each_pending([&](bool is_del, const int* lits, size_t num) {
+                if (is_del) proof.del(lits, num);
+                else proof.add(lits, num);
+            });
+            proof.flush();
+        }
+        return best_idx;
     }
 
 private:
@@ -938,21 +2696,54 @@ private:
     size_t num_vars = 0;
     size_t num_clauses = 0;
     size_t curr_clause = 0;
+    size_t num_input_clauses = 0; // clauses [0, num_input_clauses) came from the input
     int adj_deleted = 0;
-    vector<Clause> clauses;
-    SBVA::Config& config;
+    // shared with clones until written, see CowVector
+    CowVector<Clause> clauses;
+    SBVA::Config config; // this formula's own copy, config.steps counts down
+    int64_t steps_budget; // config.steps to start with
     ClauseCache* cache = nullptr;
 
     // maps each literal to a vector of clauses that contain it
-    vector< vector<int> > lit_to_clauses;
-    vector<int> lit_count_adjust;
+    CowVector< vector<int> > lit_to_clauses;
+    CowVector<int> lit_count_adjust;
 
     uint32_t adjacency_matrix_width;
-    vector< Eigen::SparseVector<int> > adjacency_matrix;
+    CowVector< Eigen::SparseVector<int> > adjacency_matrix;
     map< int, int > tmp_heuristic_cache_full;
 
-    // proof storage
-    vector<ProofClause> proof;
+    // proof output
+    ProofWriter proof;
+
+    // wall-clock and CPU-time limits
+    chrono::steady_clock::time_point start_wall;
+    double start_cpu = 0;
+    uint32_t limit_polls = 0;
+    SBVA::StopReason stop_reason = SBVA::Completed;
+    size_t replacements = 0;
+    double run_time = 0; // wall-clock seconds spent in run()
+    chrono::steady_clock::time_point run_start;
+    bool running = false;
+    const std::atomic<bool>* cancel = nullptr; // once set, the run stops at its next limit check
+    const std::atomic<bool>* portfolio_decided = nullptr; // the same, set by a first_done run_portfolio()
+    int64_t slice_end = std::numeric_limits<int64_t>::min(); // see run()
+    Engine engine;
+    // called after every progress_every-th replacement made by this
+    // formula itself, so not by the parts of run_parts()
+    std::function<void(const SBVA::Stats&)> progress;
+    uint64_t progress_every = 1;
+
+    // memory budget accounting, see mem_footprint()
+    size_t lits_stored = 0;
+    size_t occs_stored = 0;
+    size_t adj_nonzeros = 0;
+    uint32_t mem_polls = 0;
+    uint64_t last_rss = 0;
+    uint64_t rss_limit = 0; // config.mem_limit, or the whole limit for a part of run_parts()
+    uint64_t footprint_at_rss = 0; // mem_footprint() when last_rss was read
+    bool mem_from_rss = true; // see mem_estimate()
+    uint64_t mem_used = 0; // mem_estimate() at the last poll
+    int mem_stage = 0;
 };
 
 }
@@ -960,15 +2751,44 @@ private:
 namespace SBVA {
 using namespace SBVAImpl;
 
+CNF::CNF(CNF&& other) noexcept : data(other.data) {
+    other.data = nullptr;
+}
+
+CNF& CNF::operator=(CNF&& other) noexcept {
+    std::swap(data, other.data);
+    return *this;
+}
+
 CNF::~CNF() {
     Formula* f = (Formula*)data;
     delete f;
     f = nullptr;
 }
 
-void CNF::run(SBVA::Tiebreak t) {
+Stats CNF::run(SBVA::Tiebreak t) {
+    Formula* f = (Formula*)data;
+    f->run(t);
+    return f->get_stats();
+}
+
+Stats CNF::run_for(SBVA::Tiebreak t, int64_t steps) {
+    Formula* f = (Formula*)data;
+    f->run(t, steps);
+    return f->get_stats();
+}
+
+Stats CNF::stats() const {
     Formula* f = (Formula*)data;
-    f->run_sbva(t);
+    return f->get_stats();
+}
+
+std::future<Stats> CNF::run_async(Tiebreak t, const std::atomic<bool>* cancel,
+        std::function<void(const Stats&)> progress, uint64_t progress_every) {
+    Formula* f = (Formula*)data;
+    return std::async(std::launch::async, [f, t, cancel, progress, progress_every]() {
+        return f->run_watched(t, cancel, progress, progress_every);
+    });
 }
 
 std::pair<int, int> CNF::to_cnf(FILE* file) {
@@ -976,18 +2796,59 @@ std::pair<int, int> CNF::to_cnf(FILE* file) {
     return f->to_cnf(file);
 }
 
+std::pair<int, int> CNF::to_delta(FILE* file) {
+    Formula* f = (Formula*)data;
+    return f->to_delta(file);
+}
+
+uint64_t CNF::count_lits(uint32_t& ret_num_vars, uint32_t& ret_num_cls) const {
+    Formula* f = (Formula*)data;
+    return f->count_lits(ret_num_vars, ret_num_cls);
+}
+
+uint64_t CNF::get_cnf(int* buf, uint64_t buf_len) const {
+    Formula* f = (Formula*)data;
+    return f->get_cnf(buf, buf_len);
+}
+
+void CNF::for_each_clause(const std::function<void(const int*, size_t)>& fn) const {
+    Formula* f = (Formula*)data;
+    f->for_each_clause(fn);
+}
+
+Delta CNF::get_delta() const {
+    Formula* f = (Formula*)data;
+    return f->get_delta();
+}
+
+void CNF::stream_proof(FILE* file) {
+    Formula* f = (Formula*)data;
+    f->stream_proof(file);
+}
+
 void CNF::to_proof(FILE* file) {
     Formula* f = (Formula*)data;
     f->to_proof(file);
 }
 
+size_t CNF::run_portfolio(const std::vector<PortfolioEntry>& entries, bool first_done,
+                          std::vector<PortfolioResult>& results, const std::atomic<bool>* cancel) {
+    Formula* f = (Formula*)data;
+    return f->run_portfolio(entries, first_done, results, cancel);
+}
+
+StopReason CNF::stop_reason() const {
+    Formula* f = (Formula*)data;
+    return f->get_stop_reason();
+}
+
 vector<int> CNF::get_cnf(uint32_t& ret_num_vars, uint32_t& ret_num_cls) {
     Formula* f = (Formula*)data;
     return f->get_cnf(ret_num_vars, ret_num_cls);
 }
 
 
-void CNF::init_cnf(uint32_t num_vars, Config& config) {
+void CNF::init_cnf(uint32_t num_vars, const Config& config) {
     assert(data == nullptr);
     Formula* f = new Formula(config);
     f->init_cnf(num_vars);
@@ -999,12 +2860,24 @@ void CNF::add_cl(const std::vector<int>& cl_lits) {
     f->add_cl(cl_lits);
 }
 
+void CNF::add_clauses(const int* lits, size_t n) {
+    Formula* f = (Formula*)data;
+    f->add_clauses(lits, n);
+}
+
 void CNF::finish_cnf() {
     Formula* f = (Formula*)data;
     f->finish_cnf();
 }
 
-void CNF::parse_cnf(FILE* file, Config& config) {
+CNF CNF::clone(const Config& config) const {
+    const Formula* f = (const Formula*)data;
+    CNF copy;
+    copy.data = (void*)new Formula(*f, config);
+    return copy;
+}
+
+void CNF::parse_cnf(FILE* file, const Config& config) {
     assert(data == nullptr);
     Formula* f = new Formula(config);
     f->read_cnf(file);
@@ -1012,6 +2885,13 @@ void CNF::parse_cnf(FILE* file, Config& config) {
     data = (void*)f;
 }
 
+void CNF::parse_cnf(const char* buf, size_t len, const Config& config) {
+    assert(data == nullptr);
+    Formula* f = new Formula(config);
+    f->read_cnf(buf, len);
+    data = (void*)f;
+}
+
 const char* get_version_tag() {
     return SBVAImpl::get_version_tag();
 }
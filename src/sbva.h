@@ -30,17 +30,39 @@ THE SOFTWARE.
 #include <cstdint>
 #include <utility>
 #include <functional>
+#include <atomic>
+#include <future>
 
 namespace SBVA {
 
+// Compression of the written CNF or proof
+enum Compression {
+    NoCompression,
+    GzipCompression,
+    XzCompression,
+    ZstdCompression,
+};
+
 struct Config {
     uint32_t verbosity = 0;
     bool generate_proof = 0;
+    bool proof_binary = 0; // binary DRAT instead of text
+    bool binary_cnf = 0; // to_cnf() writes the binary CNF format
+    Compression cnf_compression = NoCompression;   // for to_cnf()
+    Compression proof_compression = NoCompression; // for stream_proof() and to_proof()
     int64_t steps = std::numeric_limits<int64_t>::max();
     unsigned int max_replacements = 0;
     bool preserve_model_cnt = 0;
     uint32_t matched_lits_cutoff = 2; // the larger, the more strict
     uint32_t matched_cls_cutoff = 2;  // the larger, the more strict
+    double time_limit = 0; // wall-clock seconds since parsing started, 0 = no limit
+    double cpu_limit = 0;  // CPU seconds since parsing started, 0 = no limit
+    uint64_t mem_limit = 0; // bytes, 0 = no limit
+    uint32_t num_threads = 1;
+    bool split_components = 0; // run() works on each connected component separately, in parallel
+    uint32_t partitions = 0; // run() reduces this many balanced parts in parallel, then the boundary
+    uint32_t speculate = 0; // run() matches this many queue entries at once, on num_threads threads
+    uint32_t rounds = 0; // run() matches this many queue entries per round, on num_threads threads, and applies the non-overlapping ones
 };
 
 enum Tiebreak {
@@ -48,23 +70,157 @@ enum Tiebreak {
     None, // use sorted order (should be equivalent to original BVA)
 };
 
+// Why the last run() returned
+enum StopReason {
+    Completed, // queue ran empty
+    StepLimit,
+    ReplaceLimit,
+    TimeLimit,
+    CpuLimit,
+    MemLimit,
+    Cancelled, // the cancel flag was set, or another portfolio entry finished first
+    SliceLimit, // run_for() used up its steps, the next run goes on from there
+};
+
+// Effort and outcome of a CNF, see CNF::run() and CNF::stats()
+struct Stats {
+    StopReason stop = Completed; // why the last run returned
+    uint32_t num_vars = 0;       // current formula
+    uint32_t num_clauses = 0;
+    uint64_t replacements = 0;   // new variables introduced so far
+    int64_t steps_used = 0;      // out of Config::steps, parsing included
+    int64_t steps_left = 0;
+    double time = 0;             // wall-clock seconds spent running
+    uint64_t mem_used = 0;       // memory in use at the last check of Config::mem_limit
+    uint32_t mem_stage = 0;      // 1: adjacency cache dropped, 2: and plain BVA tie-break
+};
+
+// One configuration for CNF::run_portfolio(). Whether a proof is kept is
+// taken from the CNF's own Config, and entries run without output.
+struct PortfolioEntry {
+    Config config;
+    Tiebreak tiebreak = ThreeHop;
+};
+
+// How one portfolio entry went
+struct PortfolioResult {
+    bool started = false; // false if a first-to-finish portfolio was decided before
+    uint32_t num_vars = 0;
+    uint32_t num_clauses = 0;
+    int64_t steps_left = 0;
+    double time = 0; // wall-clock seconds of its run
+    StopReason stop = Completed;
+};
+
+// What run() changed relative to the input formula, for callers that keep
+// the input and patch it rather than reloading the whole result
+struct Delta {
+    uint32_t num_vars = 0; // after run(), new variables follow the input ones
+    // 0-based indices of removed input clauses, in input order. Duplicate
+    // clauses dropped while reading the input are included.
+    std::vector<uint32_t> removed;
+    std::vector<int> added; // new clauses, each terminated by 0
+    uint32_t num_added = 0;
+};
+
+// A CNF keeps its own copy of the Config it is created with and counts its
+// steps there, so one Config can be used for many CNFs. Distinct CNFs
+// (clones included) share no mutable state and can be used on different
+// threads at the same time; a single CNF must not be used from two threads
+// at once.
 struct CNF {
+    CNF() = default;
+    CNF(CNF&& other) noexcept;
+    CNF& operator=(CNF&& other) noexcept;
+    CNF(const CNF&) = delete;
+    CNF& operator=(const CNF&) = delete;
     ~CNF();
-    void run(Tiebreak t);
+    Stats run(Tiebreak t);
+    // Like run(), but stops with SliceLimit once about steps more steps are
+    // used. The queue and the rest of the run's state stay in the CNF, so
+    // the next run_for() or run() goes on where this one stopped (under the
+    // tie-break it started with), and any sequence of slices gives the same
+    // formula, proof and steps as one run(). Between slices the formula is
+    // complete and can be read or cloned, e.g. to hand it to a SAT solver.
+    // Runs stopped by a limit or a cancel go on the same way; only a run
+    // whose queue ran empty, or one after run_portfolio(), starts over. The
+    // split_components, partitions and rounds modes do not stop between
+    // slices.
+    Stats run_for(Tiebreak t, int64_t steps);
+    Stats stats() const;
+    // run() on a thread of its own. Once *cancel is set (if given), the run
+    // stops before its next replacement (with Config::speculate, after the
+    // batch being committed) with stop reason Cancelled, and the formula is
+    // as valid as after any other stop. progress, if given, is
+    // called on that thread after every progress_every-th replacement (never
+    // with 0) and once more when the run ends; stop only means something in
+    // that last call. In the split_components and partitions modes the parts
+    // report nothing until they are merged. Leave the CNF alone until the
+    // future is ready.
+    std::future<Stats> run_async(Tiebreak t, const std::atomic<bool>* cancel = nullptr,
+                                 std::function<void(const Stats&)> progress = nullptr,
+                                 uint64_t progress_every = 1000);
+    // Instead of run(): runs every entry on its own copy of the formula,
+    // Config::num_threads entries at a time, and keeps the result with the
+    // fewest clauses (the earliest entry on ties). With first_done, the
+    // first entry to return is kept and the ones still running are
+    // cancelled. Time limits still count from parsing, so they bound the
+    // whole portfolio, and the entries running at once split what is left
+    // of this CNF's Config::mem_limit. Setting cancel cancels all entries,
+    // as with run_async(). Returns the index of the kept entry and fills in
+    // results, one per entry. stats() then reports the steps used and left
+    // of the kept entry, out of its own Config::steps.
+    size_t run_portfolio(const std::vector<PortfolioEntry>& entries, bool first_done,
+                         std::vector<PortfolioResult>& results,
+                         const std::atomic<bool>* cancel = nullptr);
 
     std::pair<int, int> to_cnf(FILE*);
     std::vector<int> get_cnf(uint32_t& ret_num_vars, uint32_t& ret_num_cls);
 
+    // Ways to get the result without an intermediate copy. for_each_clause()
+    // calls fn with the literals of each live clause, in place. count_lits()
+    // tells how large a buffer get_cnf(buf, buf_len) needs: the literal count
+    // plus ret_num_cls for the 0 after each clause. get_cnf() returns the
+    // number of ints it wrote.
+    void for_each_clause(const std::function<void(const int*, size_t)>& fn) const;
+    uint64_t count_lits(uint32_t& ret_num_vars, uint32_t& ret_num_cls) const;
+    uint64_t get_cnf(int* buf, uint64_t buf_len) const;
+
+    // Only the changes: "p delta <vars> <removed> <added>", then "d <index>"
+    // for each removed input clause and the added clauses in DIMACS
+    std::pair<int, int> to_delta(FILE*);
+    Delta get_delta() const;
+
+    // Write the DRAT proof to this file while run() is going, instead of
+    // keeping it in memory for to_proof(). Call before run(). A compressed
+    // proof stream is only complete once the CNF is destroyed.
+    void stream_proof(FILE*);
     void to_proof(FILE*);
+    StopReason stop_reason() const;
 
-    // Read in CNF from file
-    void parse_cnf(FILE* file, Config& config);
+    // Read in CNF from file, DIMACS or the binary format written with
+    // Config::binary_cnf (detected from its first bytes)
+    void parse_cnf(FILE* file, const Config& config);
+    // Same from memory, e.g. a CNF received over the network. The text is
+    // parsed in place without copying and need not be NUL-terminated.
+    void parse_cnf(const char* data, size_t len, const Config& config);
 
     // This is how to add a CNF clause by clause
-    void init_cnf(uint32_t num_vars, Config& config);
+    void init_cnf(uint32_t num_vars, const Config& config);
     void add_cl(const std::vector<int>& cl_lits);
+    // Many clauses at once: n ints, each clause terminated by 0, as returned
+    // by get_cnf(). Faster than add_cl() per clause.
+    void add_clauses(const int* lits, size_t n);
     void finish_cnf();
 
+    // A copy of the formula as it is now (after parsing or finish_cnf()),
+    // to be run under config. Clauses, occurrence lists and adjacency rows
+    // are kept in chunks shared with the original until either side writes
+    // to one, so cloning costs a pointer per chunk and a run copies only the
+    // chunks it changes. The clone's proof starts empty. The clone and the
+    // original can be used on different threads.
+    CNF clone(const Config& config) const;
+
     void* data = nullptr;
 };
 
@@ -0,0 +1,110 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+// Writes compressed output to a sink that fails, a pipe nobody reads, and
+// checks that the writer exits with an error instead of succeeding silently
+// or hanging. Small outputs only fail when finish() flushes them, medium ones
+// when the encoder writes everything at the end, large ones while
+// compressing. Each case runs in a child process, as the writer exits
+// on errors; a child that hangs is killed by an alarm.
+
+#include "compress.h"
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+using std::cout;
+using std::endl;
+using std::string;
+using namespace SBVAImpl;
+
+// Clause-like lines from a fixed generator, so compression has work to do
+string make_text(size_t len) {
+    string s;
+    uint64_t seed = 1;
+    while (s.size() < len) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        s += std::to_string((int)((seed >> 33) % 100000) - 50000) + " 0\n";
+    }
+    return s;
+}
+
+// Exit status of a child writing text compressed with codec, to a pipe
+// whose reading end is closed if failing is set, else to a temporary file.
+// -1 if it was killed.
+int run_child(Codec codec, const string& text, bool failing) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        alarm(60);
+        FILE* out;
+        if (failing) {
+            int fds[2];
+            if (pipe(fds) != 0) _exit(2);
+            close(fds[0]);
+            out = fdopen(fds[1], "wb");
+        } else {
+            out = tmpfile();
+        }
+        if (out == nullptr) _exit(2);
+        {
+            Compressor c(out, codec);
+            for (size_t i = 0; i < text.size(); i += Compressor::chunk_size) {
+                c.write(text.data() + i, std::min(Compressor::chunk_size, text.size() - i));
+            }
+            c.finish();
+        }
+        _exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main() {
+    const Codec codecs[] = {Codec::Gzip, Codec::Xz, Codec::Zstd};
+    const string small = make_text(100);
+    const string medium = make_text(64 << 10);
+    const string large = make_text(2 << 20);
+
+    int bad = 0;
+    int cases = 0;
+    for (Codec codec : codecs) {
+        if (!codec_supported(codec)) continue;
+        for (const string* text : {&small, &medium, &large}) {
+            const char* size = text == &small ? "small" : text == &medium ? "medium" : "large";
+            int ok = run_child(codec, *text, false);
+            int failing = run_child(codec, *text, true);
+            cases++;
+            if (ok != 0 || failing != 1) {
+                cout << codec_name(codec) << " " << size << ": exit " << ok
+                    << " on a working sink, " << failing << " on a failing one" << endl;
+                bad++;
+            }
+        }
+    }
+    if (bad) return 1;
+    cout << "OK, " << cases << " cases fail cleanly on a failing sink" << endl;
+    return 0;
+}
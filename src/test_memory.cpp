@@ -0,0 +1,140 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+// Runs SBVA under memory limits placed around the memory in use at the
+// start of a run, and checks that each degradation stage fires in its band:
+// none well below the limit, dropping the adjacency cache from 3/4 of it,
+// the plain BVA tie-break from 9/10 of it, and a stop at the limit itself.
+// The run grows to about 1.35 times its start, which the limits allow for.
+// Each limit runs in a child process, so that memory the allocator keeps
+// from one run does not count against the next.
+// Linux only, as the memory in use is the RSS read from /proc.
+
+#include "sbva.h"
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// Blocks of (a_i v b_j v c) clauses with some left out, which SBVA can
+// factor, plus random 3-clauses
+string make_cnf() {
+    const int blocks = 800, rows = 12, cols = 10, block_vars = rows + cols + 1;
+    const int vars = blocks * block_vars + 8000;
+    uint64_t seed = 1;
+    auto rnd = [&](int n) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (int)((seed >> 33) % n);
+    };
+    vector<vector<int>> cls;
+    for (int k = 0; k < blocks; k++) {
+        const int base = k * block_vars;
+        for (int i = 1; i <= rows; i++) {
+            for (int j = 1; j <= cols; j++) {
+                if (rnd(10) == 0) continue;
+                cls.push_back({base + i, base + rows + j, -(base + block_vars)});
+            }
+        }
+    }
+    for (int i = 0; i < 24000; i++) {
+        vector<int> cl;
+        for (int j = 0; j < 3; j++) cl.push_back((rnd(vars) + 1) * (rnd(2) ? 1 : -1));
+        cls.push_back(cl);
+    }
+    string s = "p cnf " + std::to_string(vars) + " " + std::to_string(cls.size()) + "\n";
+    for (const auto& cl : cls) {
+        for (int l : cl) s += std::to_string(l) + " ";
+        s += "0\n";
+    }
+    return s;
+}
+
+// The memory in use at the start of a run of a clone of base. A zero-step
+// slice only does the checks before the first step, which include the
+// first memory poll.
+uint64_t start_mem(const SBVA::CNF& base) {
+    SBVA::Config probe;
+    probe.mem_limit = UINT64_MAX / 2;
+    SBVA::CNF cnf = base.clone(probe);
+    return cnf.run_for(SBVA::Tiebreak::ThreeHop, 0).mem_used;
+}
+
+// Runs a clone of base in a child process, under limit times the memory in
+// use at its start. Returns the stage reached, plus 4 if it stopped on the
+// limit, or -1. The start is measured in the child, as a forked process
+// only counts the pages of the binary it has touched itself.
+int run_child(const SBVA::CNF& base, double limit) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        SBVA::Config config;
+        config.mem_limit = (uint64_t)(start_mem(base) * limit);
+        SBVA::CNF cnf = base.clone(config);
+        const SBVA::Stats st = cnf.run(SBVA::Tiebreak::ThreeHop);
+        _exit(st.mem_stage + (st.stop == SBVA::MemLimit ? 4 : 0));
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main() {
+    const string input = make_cnf();
+    SBVA::Config config;
+    SBVA::CNF base;
+    base.parse_cnf(input.data(), input.size(), config);
+
+    const uint64_t start = start_mem(base);
+    if (start == 0) {
+        cout << "no memory in use reported" << endl;
+        return 1;
+    }
+
+    struct Case {
+        const char* name;
+        double limit; // times start
+        int expect;
+    };
+    const Case cases[] = {
+        {"no stage", 2.5, 0},
+        {"adjacency cache dropped", 1.68, 1},
+        {"plain BVA tie-break", 1.42, 2},
+        {"stopped", 0.8, 4},
+    };
+    int bad = 0;
+    for (const Case& c : cases) {
+        const int got = run_child(base, c.limit);
+        if (got != c.expect) {
+            cout << c.name << ": expected " << c.expect << ", got " << got << endl;
+            bad++;
+        }
+    }
+    if (bad) return 1;
+    cout << "OK, each memory stage fires in its band around " << start / (1024 * 1024)
+        << " MB" << endl;
+    return 0;
+}
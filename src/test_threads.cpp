@@ -0,0 +1,187 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+// Runs independent CNFs on several threads at once, all created from one
+// shared Config, half of them parsed and half cloned from a shared base, and
+// checks that each gives the same formula and steps as when run alone.
+// Then cancels run_async()s from their progress callback, with and without
+// speculation, and checks that each stops right there (at the end of the
+// batch when speculating) and that running on gives the uncancelled result.
+// Build with -DSANITIZE_THREAD=ON to have ThreadSanitizer watch it.
+
+#include "sbva.h"
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// Blocks of (a_i v b_j v c) clauses with some left out, which SBVA can
+// factor, plus random 3-clauses
+string make_cnf() {
+    const int blocks = 20, rows = 12, cols = 10, block_vars = rows + cols + 1;
+    const int vars = blocks * block_vars + 200;
+    uint64_t seed = 1;
+    auto rnd = [&](int n) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (int)((seed >> 33) % n);
+    };
+    vector<vector<int>> cls;
+    for (int k = 0; k < blocks; k++) {
+        const int base = k * block_vars;
+        for (int i = 1; i <= rows; i++) {
+            for (int j = 1; j <= cols; j++) {
+                if (rnd(10) == 0) continue;
+                cls.push_back({base + i, base + rows + j, -(base + block_vars)});
+            }
+        }
+    }
+    for (int i = 0; i < 600; i++) {
+        vector<int> cl;
+        for (int j = 0; j < 3; j++) cl.push_back((rnd(vars) + 1) * (rnd(2) ? 1 : -1));
+        cls.push_back(cl);
+    }
+    string s = "p cnf " + std::to_string(vars) + " " + std::to_string(cls.size()) + "\n";
+    for (const auto& cl : cls) {
+        for (int l : cl) s += std::to_string(l) + " ";
+        s += "0\n";
+    }
+    return s;
+}
+
+struct Result {
+    vector<int> cnf;
+    int64_t steps_used = 0;
+    uint64_t replacements = 0;
+};
+
+Result run_one(SBVA::CNF& cnf, int job) {
+    SBVA::Stats st = cnf.run(job % 2 ? SBVA::Tiebreak::None : SBVA::Tiebreak::ThreeHop);
+    Result r;
+    uint32_t num_vars, num_cls;
+    r.cnf = cnf.get_cnf(num_vars, num_cls);
+    r.steps_used = st.steps_used;
+    r.replacements = st.replacements;
+    return r;
+}
+
+int main() {
+    const string input = make_cnf();
+    const int jobs = 8;
+    SBVA::Config config; // shared by all CNFs below
+
+    SBVA::CNF base;
+    base.parse_cnf(input.data(), input.size(), config);
+    const int64_t parse_steps = base.stats().steps_used;
+
+    vector<Result> alone(jobs);
+    for (int job = 0; job < jobs; job++) {
+        SBVA::CNF cnf = base.clone(config);
+        alone[job] = run_one(cnf, job);
+    }
+
+    vector<Result> together(jobs);
+    vector<std::thread> threads;
+    for (int job = 0; job < jobs; job++) {
+        threads.emplace_back([&, job]() {
+            if (job < jobs / 2) {
+                SBVA::CNF cnf;
+                cnf.parse_cnf(input.data(), input.size(), config);
+                together[job] = run_one(cnf, job);
+            } else {
+                SBVA::CNF cnf = base.clone(config);
+                together[job] = run_one(cnf, job);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    int bad = 0;
+    uint64_t replacements = 0;
+    for (int job = 0; job < jobs; job++) {
+        // clones start counting after parsing
+        const int64_t parsing = job < jobs / 2 ? parse_steps : 0;
+        replacements += together[job].replacements;
+        const bool same_cnf = alone[job].cnf == together[job].cnf;
+        const bool same_steps = alone[job].steps_used + parsing == together[job].steps_used;
+        if (!same_cnf || !same_steps) {
+            cout << "job " << job << " differs:" << (same_cnf ? "" : " formula")
+                << (same_steps ? "" : " steps") << endl;
+            bad++;
+        }
+    }
+    if (bad) return 1;
+    cout << "OK, " << jobs << " concurrent runs (" << replacements
+        << " replacements) match their serial runs" << endl;
+
+    // the cancel is seen before the next replacement, or batch
+    auto check_cancel = [&](const SBVA::Config& cfg, uint64_t every, const Result& whole) {
+        SBVA::CNF cnf = base.clone(cfg);
+        std::atomic<bool> cancel(false);
+        int reports = 0;
+        SBVA::Stats last;
+        auto future = cnf.run_async(SBVA::Tiebreak::ThreeHop, &cancel,
+            [&](const SBVA::Stats& st) {
+                reports++;
+                last = st;
+                cancel = true;
+            }, every);
+        const SBVA::Stats st = future.get();
+        uint32_t num_vars, num_cls;
+        const vector<int> lits = cnf.get_cnf(num_vars, num_cls);
+        const uint64_t batch = cfg.speculate > 1 ? cfg.speculate : 1;
+        if (st.stop != SBVA::Cancelled || st.replacements < every
+                || st.replacements >= every + batch || reports != (int)(st.replacements / every + 1)
+                || last.replacements != st.replacements || num_cls != st.num_clauses) {
+            cout << "cancelled run: stop " << st.stop << ", " << st.replacements
+                << " replacements, " << reports << " reports, " << num_cls << " clauses of "
+                << st.num_clauses << endl;
+            return false;
+        }
+        // and the run goes on where it stopped
+        if (cnf.run(SBVA::Tiebreak::ThreeHop).stop != SBVA::Completed
+                || cnf.get_cnf(num_vars, num_cls) != whole.cnf) {
+            cout << "run after cancel at " << every << " differs from the whole run"
+                << (cfg.speculate > 1 ? " with speculation" : "") << endl;
+            return false;
+        }
+        return true;
+    };
+
+    SBVA::Config spec_config = config;
+    spec_config.speculate = 8;
+    spec_config.num_threads = 2;
+    SBVA::CNF spec_cnf = base.clone(spec_config);
+    const Result spec_whole = run_one(spec_cnf, 0);
+    for (uint64_t every : {1, 3, 10}) {
+        if (!check_cancel(config, every, alone[0])) return 1;
+        if (!check_cancel(spec_config, every, spec_whole)) return 1;
+    }
+    cout << "OK, runs cancelled after 1, 3 and 10 replacements go on to the whole run, "
+        << "with and without speculation" << endl;
+    return 0;
+}
@@ -0,0 +1,392 @@
+/******************************************
+Copyright (C) 2024 Mate Soos
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+***********************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#if !defined(_MSC_VER) && !defined(_WIN32)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#define SBVA_RAW_WRITE
+#endif
+
+#include "parallel.h"
+#include "compress.h"
+
+namespace SBVAImpl {
+
+// "00".."99", so integers can be formatted two digits at a time
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Formats v right-aligned so that it ends at end, returns where it starts.
+static inline char* format_uint(uint64_t v, char* end) {
+    char* p = end;
+    while (v >= 100) {
+        const uint32_t r = (uint32_t)(v % 100) * 2;
+        v /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + r, 2);
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + v * 2, 2);
+    } else {
+        *--p = (char)('0' + v);
+    }
+    return p;
+}
+
+static inline char* format_int(int64_t v, char* end) {
+    const uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    char* p = format_uint(u, end);
+    if (v < 0) *--p = '-';
+    return p;
+}
+
+// Largest number of bytes format_clause() can produce
+static inline size_t max_clause_text(size_t num_lits) {
+    return num_lits * 12 + 2;
+}
+
+// Formats "l1 l2 ... 0\n" starting at dst, returns the end of the text.
+static inline char* format_clause(const int* lits, size_t num, char* dst) {
+    char tmp[12];
+    for (size_t i = 0; i < num; i++) {
+        char* start = format_int(lits[i], tmp + sizeof(tmp));
+        const size_t len = tmp + sizeof(tmp) - start;
+        memcpy(dst, start, len);
+        dst[len] = ' ';
+        dst += len + 1;
+    }
+    dst[0] = '0';
+    dst[1] = '\n';
+    return dst + 2;
+}
+
+// Writes all of buf to fd, retrying on short writes. Returns false on error.
+static inline bool write_all(int fd, const char* buf, size_t len) {
+#ifdef SBVA_RAW_WRITE
+    while (len > 0) {
+        ssize_t w = ::write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += w;
+        len -= w;
+    }
+    return true;
+#else
+    (void)fd; (void)buf; (void)len;
+    return false;
+#endif
+}
+
+// Output buffer for DIMACS and DRAT text. Everything is formatted into a
+// large user-space buffer that goes out with one write() per flush. The
+// FILE* is flushed first and then bypassed via its descriptor, so no stdio
+// locking or format parsing happens per literal. Streams without a usable
+// descriptor (e.g. fmemopen) fall back to fwrite(). With a codec, full
+// buffers are handed to a Compressor instead, which writes the compressed
+// stream from its own thread; the stream is finished on destruction.
+class BufferedWriter {
+public:
+    explicit BufferedWriter(FILE* _out, Codec codec = Codec::Plain, size_t _cap = 1 << 20) :
+        out(_out), cap(_cap)
+    {
+        buf = (char*)malloc(cap);
+        if (buf == nullptr) {
+            fprintf(stderr, "Error: out of memory allocating output buffer\n");
+            exit(1);
+        }
+        pos = buf;
+        end = buf + cap;
+        fflush(out);
+        if (codec != Codec::Plain) {
+            comp.reset(new Compressor(out, codec));
+            return;
+        }
+#ifdef SBVA_RAW_WRITE
+        fd = fileno(out);
+#endif
+    }
+
+    ~BufferedWriter() {
+        flush();
+        comp.reset();
+        free(buf);
+    }
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    void put(char c) {
+        if (pos == end) flush();
+        *pos++ = c;
+    }
+
+    void put(const char* str, size_t len) {
+        if ((size_t)(end - pos) < len) {
+            flush();
+            if (len > cap) {
+                raw_write(str, len);
+                return;
+            }
+        }
+        memcpy(pos, str, len);
+        pos += len;
+    }
+
+    // Writes lit followed by a space
+    void put_lit(int lit) {
+        if (end - pos < 13) flush();
+        char tmp[12];
+        char* start = format_int(lit, tmp + sizeof(tmp));
+        const size_t len = tmp + sizeof(tmp) - start;
+        memcpy(pos, start, len);
+        pos[len] = ' ';
+        pos += len + 1;
+    }
+
+    void put_uint(uint64_t v) {
+        char tmp[20];
+        char* start = format_uint(v, tmp + sizeof(tmp));
+        put(start, tmp + sizeof(tmp) - start);
+    }
+
+    // Writes a whole clause as "l1 l2 ... 0\n"
+    void put_clause(const int* lits, size_t num) {
+        if ((size_t)(end - pos) >= max_clause_text(num)) {
+            pos = format_clause(lits, num, pos);
+            return;
+        }
+        for (size_t i = 0; i < num; i++) put_lit(lits[i]);
+        put("0\n", 2);
+    }
+
+    void flush() {
+        if (pos != buf) raw_write(buf, pos - buf);
+        pos = buf;
+    }
+
+    size_t buffered() const { return pos - buf; }
+    size_t capacity() const { return cap; }
+    uint64_t bytes_written() const { return written + (pos - buf); }
+
+    // Set when the output is compressed, for write_parallel()
+    Compressor* compressor() const { return comp.get(); }
+
+private:
+    void raw_write(const char* data, size_t len) {
+        written += len;
+        if (comp) {
+            comp->write(data, len);
+            return;
+        }
+        if (fd >= 0) {
+            if (!write_all(fd, data, len)) {
+                fprintf(stderr, "Error: could not write output: %s\n", strerror(errno));
+                exit(1);
+            }
+            return;
+        }
+        if (fwrite(data, 1, len, out) != len) {
+            fprintf(stderr, "Error: could not write output\n");
+            exit(1);
+        }
+    }
+
+    FILE* out;
+    int fd = -1;
+    size_t cap;
+    char* buf;
+    char* pos;
+    char* end;
+    uint64_t written = 0;
+    std::unique_ptr<Compressor> comp;
+};
+
+// Growable text buffer that one thread formats a chunk of output into.
+struct ChunkBuffer {
+    ChunkBuffer() = default;
+    ChunkBuffer(const ChunkBuffer&) = delete;
+    ChunkBuffer& operator=(const ChunkBuffer&) = delete;
+    ~ChunkBuffer() { free(data); }
+
+    void put_clause(const int* lits, size_t num) {
+        const size_t need = max_clause_text(num);
+        if (cap - size < need) {
+            cap = std::max(cap * 2, size + need);
+            data = (char*)realloc(data, cap);
+            if (data == nullptr) {
+                fprintf(stderr, "Error: out of memory allocating output buffer\n");
+                exit(1);
+            }
+        }
+        size = format_clause(lits, num, data + size) - data;
+    }
+
+    char* data = nullptr;
+    size_t size = 0;
+    size_t cap = 0;
+};
+
+#ifdef SBVA_RAW_WRITE
+// writev() that retries until all of iov went out. Returns false on error.
+static inline bool writev_all(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t w = ::writev(fd, iov, std::min(iovcnt, IOV_MAX));
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
+}
+
+static inline bool pwrite_all(int fd, const char* buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t w = ::pwrite(fd, buf, len, off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += w;
+        len -= w;
+        off += w;
+    }
+    return true;
+}
+#endif
+
+// Parallel, chunked serialisation. Items [0, num_items) are cut into chunks
+// of chunk_items; each round, every thread formats one chunk into its own
+// ChunkBuffer via fmt(item, buffer), and the round's buffers are then written
+// in order, so the output is byte-identical to formatting serially. Regular
+// files are written by the threads themselves with pwrite() at offsets
+// computed from the chunk sizes; pipes and terminals get one writev() per
+// round, and streams without a descriptor get fwrite(). With a compressor,
+// the round's buffers are queued to it in order instead.
+template<class Fmt>
+void write_parallel(FILE* out, size_t num_items, uint32_t num_threads, const Fmt& fmt,
+                    Compressor* comp = nullptr, size_t chunk_items = 1 << 15)
+{
+    num_threads = std::max<uint32_t>(num_threads, 1);
+    fflush(out);
+
+    int fd = -1;
+    bool positional = false;
+#ifdef SBVA_RAW_WRITE
+    off_t offset = 0;
+    if (comp == nullptr) fd = fileno(out);
+    if (fd >= 0) {
+        struct stat st;
+        positional = fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+            && (fcntl(fd, F_GETFL) & O_APPEND) == 0
+            && (offset = lseek(fd, 0, SEEK_CUR)) >= 0;
+    }
+#endif
+
+    std::vector<ChunkBuffer> bufs(num_threads);
+    bool failed = false;
+    for (size_t round = 0; round < num_items; round += chunk_items * num_threads) {
+        parallel_run(num_threads, [&](uint32_t t) {
+            ChunkBuffer& b = bufs[t];
+            b.size = 0;
+            const size_t from = std::min(num_items, round + t * chunk_items);
+            const size_t to = std::min(num_items, from + chunk_items);
+            for (size_t i = from; i < to; i++) fmt(i, b);
+        });
+
+        if (comp != nullptr) {
+            for (auto& b : bufs) comp->write(b.data, b.size);
+            continue;
+        }
+
+#ifdef SBVA_RAW_WRITE
+        if (positional) {
+            std::vector<off_t> offs(num_threads);
+            for (uint32_t t = 0; t < num_threads; t++) {
+                offs[t] = offset;
+                offset += bufs[t].size;
+            }
+            std::vector<char> ok(num_threads, 1);
+            parallel_run(num_threads, [&](uint32_t t) {
+                ok[t] = pwrite_all(fd, bufs[t].data, bufs[t].size, offs[t]);
+            });
+            failed |= std::find(ok.begin(), ok.end(), 0) != ok.end();
+            continue;
+        }
+        if (fd >= 0) {
+            std::vector<struct iovec> iov;
+            for (auto& b : bufs) {
+                if (b.size != 0) iov.push_back({b.data, b.size});
+            }
+            failed |= !writev_all(fd, iov.data(), (int)iov.size());
+            continue;
+        }
+#endif
+        for (auto& b : bufs) {
+            failed |= fwrite(b.data, 1, b.size, out) != b.size;
+        }
+    }
+
+#ifdef SBVA_RAW_WRITE
+    if (positional) lseek(fd, offset, SEEK_SET);
+#endif
+    if (failed) {
+        fprintf(stderr, "Error: could not write output: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+}